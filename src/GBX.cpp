@@ -8,589 +8,4776 @@
 
 namespace // unamed
 {
-  Scene * scene;
-  PtrVector<PtrVector<IRenderable>> layers(RENDERABLES_BY_LAYER_INITIAL_CAPACITY, true);
+  Canvas screen;
+  Scene * scene; // scene being updated or drawn
+  Scene* topScene = NULL; // current scene, top of the stack
+  Scene* loadingScene = NULL;
+  Scene* sceneStack[SCENE_STACK_SIZE]; // scenes below the current one
+  uint8_t sceneModes[SCENE_STACK_SIZE];
+  uint16_t* sceneSnapshots[SCENE_STACK_SIZE];
+  uint8_t sceneDepth = 0;
+  uint8_t sceneLevel = 0; // level of the scene being updated or drawn
+  uint32_t loadBudget;
+  uint16_t loadStep;
+  uint16_t loadSteps;
   uint16_t entityCount; // FIXME
   uint8_t debugLevel = 0;
+  uint32_t frameDuration;
+  uint32_t tick = 0;
+
+  bool fixedTimestep = false;
+  uint8_t maxFrameSkip;
+  uint8_t skippedDraws;
+  int32_t accumulator;
+  uint32_t lastFrameTime;
+  bool inputEdges = true;
+  uint8_t buttons = 0;
+  uint8_t previousButtons = 0;
+
+  void readButtons();
+#if AUDIO
+  void updateAudio();
+#endif
+#if SAVE_STATES
+  void updateSaving();
+#endif
+#if POST_EFFECTS
+  void prepareEffects(int16_t& shakeX, int16_t& shakeY); // once per frame
+  void applyEffects(int16_t shakeX, int16_t shakeY); // whole screen
+  void applyColors(uint16_t* pixels, int16_t count); // color lookup only
+#endif
+#if STRIP_RENDERER
+  DisplaySink* stripSink = NULL;
+  uint16_t* strips[2];
+  uint8_t stripHeight;
+#endif
+  FrameStats frameStats;
+  FrameStats lastFrameStats;
+
+#if PROFILER
+  uint16_t profileSamples[PROFILER_FRAMES][PROFILE_SLOTS];
+  uint8_t profileFrame = 0;
+#endif
+
+#if COLLISION_STATS
+  CollisionStats collisionStats[COLLISION_STATS_TYPES + 1][COLLISION_STATS_TYPES];
+  CollisionStats lastCollisionStats[COLLISION_STATS_TYPES + 1][COLLISION_STATS_TYPES];
+  uint8_t querierType = QUERIER_NONE;
+#endif
+
+  enum
+  {
+    DEBUG_OFF,
+    DEBUG_METRICS,
+    DEBUG_HITBOXES,
+#if PROFILER
+    DEBUG_PROFILER,
+    DEBUG_PROFILER_DETAILS,
+#endif
+#if COLLISION_STATS
+    DEBUG_COLLISIONS,
+#endif
+    DEBUG_LEVELS
+  };
+  uint16_t elapsed(uint32_t start)
+  {
+    uint32_t time = micros() - start;
+    return time > 0xFFFF ? 0xFFFF : time;
+  }
 } // unamed
 
-const int16_t gbx::width = gb.display.width();
-const int16_t gbx::height = gb.display.height();
+#if CAPTURE || INPUT_REPLAY || SAVE_STATES
+namespace
+{
+  // buffered so that the SD card is only hit once per buffer
+  class FileWriter
+  {
+  public:
+    bool open(const char* path, uint16_t bufferSize)
+    {
+      file = SD.open(path, O_WRITE | O_CREAT | O_TRUNC);
+      if (!file)
+      {
+        return false;
+      }
+
+      buffer = (uint8_t*)malloc(bufferSize);
+      if (buffer == NULL)
+      {
+        file.close();
+        return false;
+      }
+
+      capacity = bufferSize;
+      size = 0;
+      failed = false;
+      return true;
+    }
+
+    void write(const void* data, uint16_t length)
+    {
+      if (size + length > capacity)
+      {
+        flush();
+        if (length > capacity)
+        {
+          // too big for the buffer, straight to the file
+          if (file.write(data, length) != length)
+          {
+            failed = true;
+          }
+          return;
+        }
+      }
+      memcpy(buffer + size, data, length);
+      size += length;
+    }
+
+    void flush()
+    {
+      if (file.write(buffer, size) != size)
+      {
+        failed = true;
+      }
+      size = 0;
+    }
+
+    bool close() // false if a write failed
+    {
+      flush();
+      file.close();
+      free(buffer);
+      buffer = NULL;
+      return !failed;
+    }
+
+    inline bool isOpen() const
+    {
+      return buffer != NULL;
+    }
+
+  private:
+    File file;
+    uint8_t* buffer = NULL;
+    uint16_t capacity = 0;
+    uint16_t size = 0;
+    bool failed = false;
+  };
+
+  // reads from a buffered file or directly from memory
+  class FileReader
+  {
+  public:
+    bool open(const char* path, uint16_t bufferSize)
+    {
+      file = SD.open(path, O_READ);
+      if (!file)
+      {
+        return false;
+      }
+
+      ownedBuffer = (uint8_t*)malloc(bufferSize);
+      if (ownedBuffer == NULL)
+      {
+        file.close();
+        return false;
+      }
+
+      buffer = ownedBuffer;
+      capacity = bufferSize;
+      size = 0;
+      position = 0;
+      return true;
+    }
+
+    void open(const uint8_t* data, uint32_t dataSize)
+    {
+      buffer = data;
+      size = dataSize;
+      position = 0;
+    }
+
+    bool read(void* data, uint16_t length)
+    {
+      if (position + length > size && ownedBuffer != NULL)
+      {
+        // move what is left to the front and refill
+        size -= position;
+        memmove(ownedBuffer, ownedBuffer + position, size);
+        position = 0;
+        int count = file.read(ownedBuffer + size, capacity - size);
+        if (count > 0)
+        {
+          size += count;
+        }
+      }
+
+      if (position + length > size)
+      {
+        return false;
+      }
+
+      memcpy(data, buffer + position, length);
+      position += length;
+      return true;
+    }
+
+    void close()
+    {
+      if (ownedBuffer != NULL)
+      {
+        file.close();
+        free(ownedBuffer);
+        ownedBuffer = NULL;
+      }
+      buffer = NULL;
+    }
+
+    inline bool isOpen() const
+    {
+      return buffer != NULL;
+    }
+
+  private:
+    File file;
+    const uint8_t* buffer = NULL;
+    uint8_t* ownedBuffer = NULL;
+    uint16_t capacity = 0;
+    uint32_t size = 0;
+    uint32_t position = 0;
+  };
+}
+#endif
+
+#if CAPTURE
+namespace
+{
+  FileWriter capture;
+
+  static_assert(sizeof(FrameStats) == 16, "FrameStats must match the capture record layout");
+
+  void captureFrame()
+  {
+    capture.write(&frameStats, sizeof(FrameStats));
+    for (uint8_t type = 0; type < CAPTURE_POOLS; type++)
+    {
+      IEntityPool* pool = scene != NULL ? scene->getPool(type) : NULL;
+      uint16_t count = pool != NULL ? pool->getCount() : 0;
+      capture.write(&count, sizeof(count));
+    }
+  }
+}
+
+bool gbx::startCapture(const char* path)
+{
+  stopCapture();
+  if (!capture.open(path, CAPTURE_BUFFER_SIZE))
+  {
+    return false;
+  }
+
+  const uint8_t header[] = { 'G', 'B', 'X', 'C', CAPTURE_VERSION, CAPTURE_POOLS, 0, 0 };
+  capture.write(header, sizeof(header));
+  capture.write(&frameDuration, sizeof(frameDuration));
+  return true;
+}
+
+void gbx::stopCapture()
+{
+  if (capture.isOpen())
+  {
+    capture.close();
+  }
+}
+
+bool gbx::isCapturing()
+{
+  return capture.isOpen();
+}
+#endif
+
+const FrameStats& gbx::getFrameStats()
+{
+  return lastFrameStats;
+}
+
+int16_t gbx::width = gb.display.width();
+int16_t gbx::height = gb.display.height();
 
 void gbx::init(uint8_t frameRate)
 {
   gb.begin();
   gb.setFrameRate(frameRate);
+  frameDuration = 1000000 / frameRate;
+  screen = Canvas(gb.display._buffer, width, height);
+}
+
+Canvas& gbx::getCanvas()
+{
+  return screen;
+}
+
+const Rect& gbx::getView()
+{
+  return screen.getClip();
+}
+
+#if PROFILER
+namespace
+{
+  void drawProfileLine(int16_t y, const char* name, uint8_t slot)
+  {
+    ProfileStats stats = gbx::getProfileStats(slot);
+    gbx::drawString(0, y, gbx::format("%s%5u%5u%5u", name, stats.min, stats.avg, stats.max));
+  }
+
+  void drawProfiler()
+  {
+    gbx::fillRect(0, 0, gbx::width, gbx::height, Color::black);
+    gbx::drawString(12, 0, "  min  avg  max");
+    drawProfileLine(6, "wt ", PROFILE_WAIT);
+    drawProfileLine(12, "upd", PROFILE_UPDATE);
+    drawProfileLine(18, "drw", PROFILE_DRAW);
+    drawProfileLine(24, "dbg", PROFILE_DEBUG);
+
+    // busy time of the previous frames, oldest first, full height is the frame budget
+    const int16_t graphHeight = 24;
+    int16_t x = (gbx::width - (PROFILER_FRAMES - 1) * 2) / 2;
+    for (uint8_t i = 1; i < PROFILER_FRAMES; i++)
+    {
+      uint16_t* samples = profileSamples[(profileFrame + i) % PROFILER_FRAMES];
+      uint32_t busy = (uint32_t)samples[PROFILE_UPDATE] + samples[PROFILE_DRAW] + samples[PROFILE_DEBUG];
+      int16_t h = busy * graphHeight / frameDuration;
+      if (h > graphHeight) h = graphHeight;
+      gbx::fillRect(x, gbx::height - h, 2, h, busy > frameDuration ? Color::red : Color::green);
+      x += 2;
+    }
+    gbx::drawFastHLine(0, gbx::height - graphHeight - 1, gbx::width, Color::gray);
+  }
+
+  void drawProfilerDetails()
+  {
+    gbx::fillRect(0, 0, gbx::width, gbx::height, Color::black);
+    gbx::drawString(12, 0, "  min  avg  max");
+    char name[4];
+    int16_t y = 6;
+    for (uint8_t i = 0; i < PROFILER_MAX_POOLS && y < gbx::height; i++)
+    {
+      if (gbx::getProfileStats(PROFILE_POOL(i)).max > 0)
+      {
+        snprintf(name, sizeof(name), "p%-2d", i);
+        drawProfileLine(y, name, PROFILE_POOL(i));
+        y += 6;
+      }
+    }
+    for (uint8_t i = 0; i < PROFILER_MAX_LAYERS && y < gbx::height; i++)
+    {
+      if (gbx::getProfileStats(PROFILE_LAYER(i)).max > 0)
+      {
+        snprintf(name, sizeof(name), "l%-2d", i);
+        drawProfileLine(y, name, PROFILE_LAYER(i));
+        y += 6;
+      }
+    }
+  }
+}
+#endif
+
+#if COLLISION_STATS
+namespace
+{
+  void drawCollisionStats()
+  {
+    gbx::fillRect(0, 0, gbx::width, gbx::height, Color::black);
+    gbx::drawString(0, 0, "q>t  cand hit");
+
+    // heatmap of candidates tested, one row per querier type (last row: no querier)
+    uint32_t maxCandidates = 1;
+    for (uint8_t q = 0; q <= COLLISION_STATS_TYPES; q++)
+    {
+      for (uint8_t t = 0; t < COLLISION_STATS_TYPES; t++)
+      {
+        if (lastCollisionStats[q][t].candidates > maxCandidates) maxCandidates = lastCollisionStats[q][t].candidates;
+      }
+    }
+
+    const int16_t cellSize = 3;
+    int16_t gridX = gbx::width - COLLISION_STATS_TYPES * cellSize;
+    for (uint8_t q = 0; q <= COLLISION_STATS_TYPES; q++)
+    {
+      for (uint8_t t = 0; t < COLLISION_STATS_TYPES; t++)
+      {
+        uint32_t candidates = lastCollisionStats[q][t].candidates;
+        if (candidates > 0)
+        {
+          uint8_t heat = candidates / (maxCandidates / 4 + 1); // 0 to 3
+          const Color colors[] = { Color::darkblue, Color::blue, Color::orange, Color::red };
+          gbx::fillRect(gridX + t * cellSize, 6 + q * cellSize, cellSize, cellSize, colors[heat]);
+        }
+      }
+    }
+
+    // most expensive pairs first
+    uint32_t listed[COLLISION_STATS_TYPES + 1] = {};
+    char line[48]; // fits any value, only the first 20 characters are on screen
+    for (int16_t y = 6; y < gbx::height; y += 6)
+    {
+      int8_t bestQ = -1;
+      int8_t bestT = -1;
+      for (uint8_t q = 0; q <= COLLISION_STATS_TYPES; q++)
+      {
+        for (uint8_t t = 0; t < COLLISION_STATS_TYPES; t++)
+        {
+          const CollisionStats& stats = lastCollisionStats[q][t];
+          if (stats.calls > 0 && !(listed[q] & (1ul << t)) &&
+            (bestQ < 0 || stats.candidates > lastCollisionStats[bestQ][bestT].candidates))
+          {
+            bestQ = q;
+            bestT = t;
+          }
+        }
+      }
+
+      if (bestQ < 0)
+      {
+        break;
+      }
+
+      listed[bestQ] |= 1ul << bestT;
+      const CollisionStats& stats = lastCollisionStats[bestQ][bestT];
+      if (bestQ == QUERIER_NONE)
+      {
+        snprintf(line, sizeof(line), "->%-2d%5lu%4lu", bestT, (unsigned long)stats.candidates, (unsigned long)stats.hits);
+      }
+      else
+      {
+        snprintf(line, sizeof(line), "%d>%-2d%5lu%4lu", bestQ, bestT, (unsigned long)stats.candidates, (unsigned long)stats.hits);
+      }
+      gbx::drawString(0, y, line);
+    }
+  }
+}
+
+void gbx::_countQuery(uint8_t targetType, uint16_t candidates, bool hit)
+{
+  if (targetType < COLLISION_STATS_TYPES)
+  {
+    CollisionStats& stats = collisionStats[querierType][targetType];
+    stats.calls++;
+    stats.candidates += candidates;
+    if (hit)
+    {
+      stats.hits++;
+    }
+  }
+}
+
+const CollisionStats& gbx::getCollisionStats(uint8_t querierType, uint8_t targetType)
+{
+  static const CollisionStats none = {};
+  if (querierType > QUERIER_NONE || targetType >= COLLISION_STATS_TYPES)
+  {
+    return none;
+  }
+  return lastCollisionStats[querierType][targetType];
+}
+#endif
+
+namespace
+{
+  // Runs a scene of the stack, level sceneDepth is the current scene. The
+  // scene pointer is switched so that queries go to the running scene.
+  void runLevel(uint8_t level, bool draw)
+  {
+    Scene* current = level < sceneDepth ? sceneStack[level] : topScene;
+    sceneLevel = level;
+    scene = current;
+
+    if (draw)
+    {
+      current->draw();
+    }
+    else
+    {
+      current->_update();
+    }
+
+    // the scene may have pushed or popped a scene
+    scene = topScene;
+    sceneLevel = sceneDepth;
+  }
+
+  void updateLevel(uint8_t level)
+  {
+    if (level > 0 && sceneModes[level - 1] == SCENE_LIVE)
+    {
+      updateLevel(level - 1);
+    }
+
+    // unless a scene below popped this level
+    if (level <= sceneDepth)
+    {
+      runLevel(level, false);
+    }
+  }
+
+  void drawLevel(uint8_t level)
+  {
+    if (level > 0)
+    {
+      // no snapshot is taken while rendering by strips
+      if (sceneModes[level - 1] == SCENE_SNAPSHOT && sceneSnapshots[level - 1] != NULL)
+      {
+        memcpy(screen.buffer, sceneSnapshots[level - 1], screen.width * screen.height * sizeof(uint16_t));
+      }
+      else
+      {
+        drawLevel(level - 1);
+      }
+    }
+    runLevel(level, true);
+  }
+
+  void clearSceneStack()
+  {
+    while (sceneDepth > 0)
+    {
+      sceneDepth--;
+      free(sceneSnapshots[sceneDepth]);
+    }
+    sceneLevel = 0;
+  }
+
+  void updateScene()
+  {
+    uint32_t time = micros();
+    if (sceneDepth > 0)
+    {
+      updateLevel(sceneDepth);
+    }
+    else
+    {
+      scene->_update();
+    }
+    tick++;
+
+    uint16_t updateTime = elapsed(time);
+    uint32_t total = (uint32_t)frameStats.updateTime + updateTime;
+    frameStats.updateTime = total > 0xFFFF ? 0xFFFF : total;
+    PROFILE(PROFILE_UPDATE, updateTime);
+  }
+
+  void drawLevels()
+  {
+    if (sceneDepth > 0)
+    {
+      drawLevel(sceneDepth);
+    }
+    else
+    {
+      scene->draw();
+    }
+  }
+
+  void drawLoadingScreen()
+  {
+    loadingScene->drawLoading(loadStep, loadSteps);
+  }
+
+  void drawOverlay()
+  {
+    if (debugLevel == DEBUG_HITBOXES && scene != NULL)
+    {
+      scene->drawDebug();
+    }
+
+#if PROFILER
+    if (debugLevel == DEBUG_PROFILER)
+    {
+      drawProfiler();
+    }
+    else if (debugLevel == DEBUG_PROFILER_DETAILS)
+    {
+      drawProfilerDetails();
+    }
+    else
+#endif
+#if COLLISION_STATS
+    if (debugLevel == DEBUG_COLLISIONS)
+    {
+      drawCollisionStats();
+    }
+    else
+#endif
+    {
+      gbx::drawText(0, 0, "cpu=");
+      gbx::drawInt(16, 0, gb.getCpuLoad());
+      gbx::drawText(0, 6, "ram=");
+      gbx::drawInt(16, 6, gb.getFreeRam());
+      gbx::drawText(0, 12, "cnt=");
+      gbx::drawInt(16, 12, entityCount);
+    }
+  }
+
+  inline bool isStripRendering()
+  {
+#if STRIP_RENDERER
+    return stripSink != NULL;
+#else
+    return false;
+#endif
+  }
+
+#if STRIP_RENDERER
+  void renderStrips(void (*draw)(), int16_t shakeX, int16_t shakeY)
+  {
+    int16_t width = screen.width;
+    int16_t height = screen.height;
+    const Rect area = { 0, 0, width, height };
+    uint8_t index = 0;
+
+    stripSink->beginFrame();
+    for (int16_t top = 0; top < height; top += stripHeight, index ^= 1)
+    {
+      int16_t rows = height - top < stripHeight ? height - top : stripHeight;
+      uint16_t* strip = strips[index];
+
+      // the shake moves the part of the screen drawn into the strip instead
+      // of the pixels, uncovered pixels stay black
+      Rect bounds = { (int16_t)-shakeX, (int16_t)(top - shakeY), width, rows };
+      bounds = bounds.intersection(area);
+      if (bounds.w < width || bounds.h < rows)
+      {
+        memset(strip, 0, width * rows * sizeof(uint16_t));
+      }
+
+      if (!bounds.isEmpty())
+      {
+        screen.setBuffer(strip + (bounds.y - top + shakeY) * width + bounds.x + shakeX, bounds);
+        draw();
+#if POST_EFFECTS
+        for (int16_t y = bounds.y; y < bounds.y + bounds.h; y++)
+        {
+          applyColors(screen.getAddress(bounds.x, y), bounds.w);
+        }
+#endif
+      }
+
+      if (debugLevel != DEBUG_OFF)
+      {
+        screen.setBuffer(strip, { 0, top, width, rows });
+        drawOverlay();
+      }
+
+      stripSink->writeStrip(strip, top, width, rows);
+    }
+    stripSink->endFrame();
+
+    // nothing is drawn outside of the frames
+    screen.setBuffer(strips[0], { 0, 0, 0, 0 });
+  }
+#endif
+
+  // draws a frame, in one go or strip by strip
+  void render(void (*draw)())
+  {
+#if POST_EFFECTS || STRIP_RENDERER
+    int16_t shakeX = 0;
+    int16_t shakeY = 0;
+#endif
+#if POST_EFFECTS
+    prepareEffects(shakeX, shakeY);
+#endif
+#if STRIP_RENDERER
+    if (stripSink != NULL)
+    {
+      renderStrips(draw, shakeX, shakeY);
+      return;
+    }
+#endif
+    draw();
+#if POST_EFFECTS
+    applyEffects(shakeX, shakeY);
+#endif
+  }
+
+  void drawScene()
+  {
+    uint32_t time = micros();
+    render(drawLevels);
+    frameStats.drawTime = elapsed(time);
+    PROFILE(PROFILE_DRAW, frameStats.drawTime);
+  }
+
+  void updateFixedTimestep(uint32_t now)
+  {
+    accumulator += now - lastFrameTime;
+    lastFrameTime = now;
+
+    // do not try to catch up more than maxFrameSkip frames, slow down instead
+    int32_t maxAccumulator = frameDuration * (maxFrameSkip + 1);
+    if (accumulator > maxAccumulator)
+    {
+      accumulator = maxAccumulator;
+    }
+
+    // gb.update() already paces the frames, tolerate some jitter on the first update
+    uint8_t updates = 0;
+    while (accumulator >= (int32_t)(updates == 0 ? frameDuration - frameDuration / 4 : frameDuration))
+    {
+      updateScene();
+      accumulator -= frameDuration;
+      updates++;
+
+      // button presses and releases are only seen by the first update of a frame
+      inputEdges = false;
+    }
+    inputEdges = true;
+
+    if (updates == 0)
+    {
+      // nothing changed, keep the previous frame
+      return;
+    }
+
+    if (updates > 1 && skippedDraws < maxFrameSkip)
+    {
+      skippedDraws++;
+      return;
+    }
+
+    skippedDraws = 0;
+    drawScene();
+  }
+
+  void updateLoading()
+  {
+    uint32_t start = micros();
+    do
+    {
+      if (loadStep == 0)
+      {
+        // the steps spawn entities and query the scene, it has to be current
+        clearSceneStack();
+        scene = loadingScene;
+        topScene = loadingScene;
+        entityCount = 0;
+        loadingScene->init();
+      }
+      else
+      {
+        loadingScene->onLoad(loadStep - 1);
+      }
+      loadStep++;
+    }
+    while (loadStep < loadSteps && micros() - start < loadBudget);
+
+    if (loadStep < loadSteps)
+    {
+      render(drawLoadingScreen);
+      return;
+    }
+
+    loadingScene = NULL;
+
+    // the loading frames do not count as elapsed game time
+    accumulator = 0;
+    lastFrameTime = micros();
+    drawScene();
+  }
+}
+
+void gbx::setFixedTimestep(bool enabled, uint8_t maxFrameSkip)
+{
+  fixedTimestep = enabled;
+  ::maxFrameSkip = maxFrameSkip;
+  skippedDraws = 0;
+  accumulator = 0;
+  lastFrameTime = micros();
+}
+
+uint32_t gbx::getTick()
+{
+  return scene != NULL ? scene->getTick() : tick;
+}
+
+void gbx::update()
+{
+  uint32_t time = micros();
+  while (!gb.update());
+
+  frameStats.frame++;
+  frameStats.waitTime = elapsed(time);
+  frameStats.updateTime = 0;
+  frameStats.drawTime = 0;
+  frameStats.queryCount = 0;
+  frameStats.pixelCount = 0;
+
+#if PROFILER
+  profileFrame = (profileFrame + 1) % PROFILER_FRAMES;
+  memset(profileSamples[profileFrame], 0, sizeof(profileSamples[profileFrame]));
+#endif
+#if COLLISION_STATS
+  memcpy(lastCollisionStats, collisionStats, sizeof(collisionStats));
+  memset(collisionStats, 0, sizeof(collisionStats));
+#endif
+  PROFILE(PROFILE_WAIT, frameStats.waitTime);
+
+  readButtons();
+#if AUDIO
+  updateAudio();
+#endif
+  if (wasPressed(BUTTON_MENU))
+  {
+    debugLevel = (debugLevel + 1) % DEBUG_LEVELS;
+  }
+
+  if (loadingScene != NULL)
+  {
+    updateLoading();
+  }
+  else if (scene != NULL)
+  {
+    if (fixedTimestep)
+    {
+      updateFixedTimestep(micros());
+    }
+    else
+    {
+      updateScene();
+      drawScene();
+    }
+  }
+
+  // the strips draw the overlay themselves
+  if (debugLevel != DEBUG_OFF && !isStripRendering())
+  {
+    PROFILE_BEGIN(debug);
+    drawOverlay();
+    PROFILE_END(debug, PROFILE_DEBUG);
+  }
+
+  lastFrameStats = frameStats;
+#if CAPTURE
+  if (capture.isOpen())
+  {
+    captureFrame();
+  }
+#endif
+#if SAVE_STATES
+  updateSaving();
+#endif
+}
+
+void gbx::setScene(Scene& scene)
+{
+  entityCount = 0;
+  loadingScene = NULL;
+  clearSceneStack();
+
+  ::scene = &scene;
+  topScene = &scene;
+  scene.init();
+}
+
+bool gbx::pushScene(Scene& scene, uint8_t mode)
+{
+  if (topScene == NULL)
+  {
+    setScene(scene);
+    return true;
+  }
+  if (sceneDepth == SCENE_STACK_SIZE)
+  {
+    return false;
+  }
+
+  // a scene below the top may be running, it gets the scene pointer back
+  Scene* running = ::scene;
+  uint8_t runningLevel = sceneLevel;
+  bool below = sceneLevel < sceneDepth;
+
+  uint16_t* snapshot = NULL;
+  if (mode == SCENE_SNAPSHOT && !isStripRendering())
+  {
+    size_t size = ::screen.width * ::screen.height * sizeof(uint16_t);
+    snapshot = (uint16_t*)malloc(size);
+    if (snapshot == NULL)
+    {
+      return false;
+    }
+
+    // the last frame has the post effects and the debug overlay on it, the
+    // scenes below are drawn again without them
+    drawLevels();
+    memcpy(snapshot, ::screen.buffer, size);
+  }
+
+  sceneStack[sceneDepth] = topScene;
+  sceneModes[sceneDepth] = mode;
+  sceneSnapshots[sceneDepth] = snapshot;
+  sceneDepth++;
+  sceneLevel = sceneDepth;
+
+  ::scene = &scene;
+  topScene = &scene;
+  scene.init();
+
+  if (below)
+  {
+    ::scene = running;
+    sceneLevel = runningLevel;
+  }
+  return true;
+}
+
+void gbx::popScene()
+{
+  if (sceneDepth == 0)
+  {
+    return;
+  }
+
+  bool below = sceneLevel < sceneDepth;
+  sceneDepth--;
+  free(sceneSnapshots[sceneDepth]);
+  topScene = sceneStack[sceneDepth];
+  if (!below)
+  {
+    sceneLevel = sceneDepth;
+    ::scene = topScene;
+  }
+}
+
+bool gbx::isOverlay()
+{
+  return sceneLevel > 0;
+}
+
+void gbx::loadScene(Scene& scene, uint16_t budget)
+{
+  loadingScene = &scene;
+  loadBudget = budget != 0 ? budget : frameDuration / 2;
+  loadStep = 0;
+  loadSteps = scene.getLoadSteps() + 1; // init is the first step
+}
+
+bool gbx::isLoading()
+{
+  return loadingScene != NULL;
+}
+
+Scene& gbx::getScene()
+{
+  return *::scene;
+}
+
+void gbx::clear(Color color)
+{
+  screen.clear(color);
+}
+
+void gbx::setPixel(int16_t x, int16_t y, Color c)
+{
+  screen.setPixel(x, y, c);
+}
+
+Color gbx::getPixel(int16_t x, int16_t y)
+{
+  return screen.getPixel(x, y);
+}
+
+void gbx::drawLine(int16_t x0, int16_t y0, int16_t x1, int16_t y1, Color c)
+{
+  screen.drawLine(x0, y0, x1, y1, c);
+}
+
+void gbx::drawFastVLine(int16_t x, int16_t y, int16_t h, Color c)
+{
+  screen.fillRect(x, y, 1, h, c);
+}
+
+void gbx::drawFastHLine(int16_t x, int16_t y, int16_t w, Color c)
+{
+  screen.fillRect(x, y, w, 1, c);
+}
+
+void gbx::drawRect(int16_t x, int16_t y, int16_t w, int16_t h, Color c)
+{
+  screen.drawRect(x, y, w, h, c);
+}
+
+void gbx::fillRect(int16_t x, int16_t y, int16_t w, int16_t h, Color c)
+{
+  screen.fillRect(x, y, w, h, c);
+}
+
+void gbx::drawCircle(int16_t x, int16_t y, int16_t r, Color c)
+{
+  screen.drawCircle(x, y, r, c);
+}
+
+void gbx::fillCircle(int16_t x, int16_t y, int16_t r, Color c)
+{
+  screen.fillCircle(x, y, r, c);
+}
+
+void gbx::drawChar(int16_t x, int16_t y, char chr, Color c, Gamebuino_Meta::GFXfont* font)
+{
+  if (font == NULL)
+  {
+    const char str[] = { chr, '\0' };
+    screen.drawText(x, y, str, c);
+    return;
+  }
+
+  gb.display.setFont(font);
+  gb.display.setColor(c);
+  gb.display.setCursor(x, y);
+  gb.display.write(chr);
+}
+
+void gbx::drawString(int16_t x, int16_t y, const char* str, Color c, Gamebuino_Meta::GFXfont* font)
+{
+  if (font == NULL)
+  {
+    drawText(x, y, str, c);
+    return;
+  }
+
+  gb.display.setFont(font);
+  gb.display.setColor(c);
+  gb.display.setCursor(x, y);
+  for (const char* chr = str; *chr != '\0'; chr++)
+  {
+    gb.display.write(*chr);
+  }
+}
+
+void gbx::drawText(int16_t x, int16_t y, const char* str, Color c, uint8_t align, const Font& font)
+{
+  screen.drawText(x, y, str, c, align, font);
+}
+
+void gbx::drawInt(int16_t x, int16_t y, int32_t value, uint8_t minDigits, Color c, uint8_t align)
+{
+  drawText(x, y, formatInt(value, minDigits), c, align);
+}
+
+uint16_t gbx::getTextWidth(const char* str, const Font& font)
+{
+  // the widest line
+  uint16_t length = 0;
+  uint16_t longest = 0;
+  for (const char* chr = str; *chr != '\0'; chr++)
+  {
+    length = *chr == '\n' ? 0 : length + 1;
+    longest = length > longest ? length : longest;
+  }
+  return longest > 0 ? longest * (font.width + font.spacing) - font.spacing : 0;
+}
+
+namespace
+{
+  char formatBuffer[128];
+  char intBuffer[12];
+}
+
+const char* gbx::formatInt(int32_t value, uint8_t minDigits)
+{
+  char* chr = intBuffer + sizeof(intBuffer) - 1;
+  *chr = '\0';
+
+  uint32_t n = value < 0 ? -(uint32_t)value : value;
+  uint8_t digits = 0;
+  do
+  {
+    *--chr = '0' + n % 10;
+    n /= 10;
+    digits++;
+  } while ((n > 0 || digits < minDigits) && chr > intBuffer + 1);
+
+  if (value < 0)
+  {
+    *--chr = '-';
+  }
+  return chr;
+}
+
+const char* gbx::format(const char* format...)
+{
+  va_list ap;
+  va_start(ap, format);
+  vsnprintf(formatBuffer, sizeof(formatBuffer), format, ap);
+  va_end(ap);
+  return formatBuffer;
+}
+
+#if PROFILER
+void gbx::_profile(uint8_t slot, uint32_t time)
+{
+  if (slot < PROFILE_SLOTS)
+  {
+    time += profileSamples[profileFrame][slot];
+    profileSamples[profileFrame][slot] = time > 0xFFFF ? 0xFFFF : time;
+  }
+}
+
+ProfileStats gbx::getProfileStats(uint8_t slot)
+{
+  ProfileStats stats = { 0xFFFF, 0, 0 };
+  if (slot >= PROFILE_SLOTS)
+  {
+    stats.min = 0;
+    return stats;
+  }
+
+  // skip the frame in progress
+  uint32_t total = 0;
+  for (uint8_t i = 1; i < PROFILER_FRAMES; i++)
+  {
+    uint16_t sample = profileSamples[(profileFrame + i) % PROFILER_FRAMES][slot];
+    if (sample < stats.min) stats.min = sample;
+    if (sample > stats.max) stats.max = sample;
+    total += sample;
+  }
+  stats.avg = total / (PROFILER_FRAMES - 1);
+  return stats;
+}
+#endif
+
+#if INPUT_REPLAY
+namespace
+{
+  FileWriter recorder;
+  uint8_t recordMask;
+  uint8_t recordLength;
+
+  FileReader replay;
+  uint8_t replayMask;
+  uint8_t replayLength;
+
+  const uint8_t INPUT_VERSION = 1;
+
+  void writeRun()
+  {
+    if (recordLength > 0)
+    {
+      const uint8_t run[] = { recordMask, recordLength };
+      recorder.write(run, sizeof(run));
+    }
+  }
+
+  bool readHeader()
+  {
+    uint8_t header[8];
+    uint32_t seed;
+    if (!replay.read(header, sizeof(header)) || memcmp(header, "GBXI", 4) != 0 || header[4] != INPUT_VERSION ||
+      !replay.read(&seed, sizeof(seed)))
+    {
+      replay.close();
+      return false;
+    }
+
+    randomSeed(seed);
+    replayLength = 0;
+    return true;
+  }
+}
+
+bool gbx::startRecording(const char* path)
+{
+  stopRecording();
+  if (!recorder.open(path, INPUT_BUFFER_SIZE))
+  {
+    return false;
+  }
+
+  const uint8_t header[] = { 'G', 'B', 'X', 'I', INPUT_VERSION, 0, 0, 0 };
+  uint32_t seed = micros();
+  recorder.write(header, sizeof(header));
+  recorder.write(&seed, sizeof(seed));
+  randomSeed(seed);
+  recordLength = 0;
+  return true;
+}
+
+void gbx::stopRecording()
+{
+  if (recorder.isOpen())
+  {
+    writeRun();
+    recorder.close();
+  }
+}
+
+bool gbx::isRecording()
+{
+  return recorder.isOpen();
+}
+
+bool gbx::startReplay(const char* path)
+{
+  stopReplay();
+  return replay.open(path, INPUT_BUFFER_SIZE) && readHeader();
+}
+
+bool gbx::startReplay(const uint8_t* data, uint32_t size)
+{
+  stopReplay();
+  replay.open(data, size);
+  return readHeader();
+}
+
+void gbx::stopReplay()
+{
+  replay.close();
+}
+
+bool gbx::isReplaying()
+{
+  return replay.isOpen();
+}
+#endif
+
+namespace
+{
+  void readButtons()
+  {
+    previousButtons = buttons;
+
+#if INPUT_REPLAY
+    // the number of loading frames depends on the load budget, they are
+    // neither recorded nor replayed and see no buttons
+    if (loadingScene != NULL && (replay.isOpen() || recorder.isOpen()))
+    {
+      buttons = 0;
+      return;
+    }
+
+    if (replay.isOpen())
+    {
+      if (replayLength == 0)
+      {
+        uint8_t run[2];
+        if (!replay.read(run, sizeof(run)))
+        {
+          replay.close();
+          buttons = 0;
+          return;
+        }
+        replayMask = run[0];
+        replayLength = run[1];
+      }
+      replayLength--;
+      buttons = replayMask;
+      return;
+    }
+#endif
+
+    buttons = 0;
+    for (uint8_t i = 0; i < 8; i++)
+    {
+      if (gb.buttons.repeat((Gamebuino_Meta::Button)i, 0))
+      {
+        buttons |= 1 << i;
+      }
+    }
+
+#if INPUT_REPLAY
+    if (recorder.isOpen())
+    {
+      if (buttons != recordMask || recordLength == 0xFF)
+      {
+        writeRun();
+        recordMask = buttons;
+        recordLength = 0;
+      }
+      recordLength++;
+    }
+#endif
+  }
+
+  inline uint8_t buttonMask(Gamebuino_Meta::Button button)
+  {
+    return 1 << (uint8_t)button;
+  }
+}
+
+bool gbx::isDown(Gamebuino_Meta::Button button)
+{
+  return buttons & buttonMask(button);
+}
+
+bool gbx::wasPressed(Gamebuino_Meta::Button button)
+{
+  return inputEdges && (buttons & ~previousButtons & buttonMask(button));
+}
+
+bool gbx::wasReleased(Gamebuino_Meta::Button button)
+{
+  return inputEdges && (previousButtons & ~buttons & buttonMask(button));
+}
+
+//-----------------------------------------------------------------------------
+// Text
+//-----------------------------------------------------------------------------
+
+namespace
+{
+  const uint8_t defaultGlyphs[] PROGMEM =
+  {
+  0x0, 0x0, 0x0, 0x0, 0x0, // space
+  0x2, 0x2, 0x2, 0x0, 0x2, // !
+  0x5, 0x5, 0x0, 0x0, 0x0, // "
+  0x5, 0x7, 0x5, 0x7, 0x5, // #
+  0x6, 0x3, 0x2, 0x6, 0x3, // $
+  0x5, 0x4, 0x2, 0x1, 0x5, // %
+  0x2, 0x5, 0x2, 0x5, 0x6, // &
+  0x2, 0x2, 0x0, 0x0, 0x0, // '
+  0x4, 0x2, 0x2, 0x2, 0x4, // (
+  0x1, 0x2, 0x2, 0x2, 0x1, // )
+  0x0, 0x5, 0x2, 0x5, 0x0, // *
+  0x0, 0x2, 0x7, 0x2, 0x0, // +
+  0x0, 0x0, 0x0, 0x2, 0x1, // ,
+  0x0, 0x0, 0x7, 0x0, 0x0, // -
+  0x0, 0x0, 0x0, 0x0, 0x2, // .
+  0x4, 0x4, 0x2, 0x1, 0x1, // /
+  0x7, 0x5, 0x5, 0x5, 0x7, // 0
+  0x2, 0x3, 0x2, 0x2, 0x7, // 1
+  0x7, 0x4, 0x7, 0x1, 0x7, // 2
+  0x7, 0x4, 0x6, 0x4, 0x7, // 3
+  0x5, 0x5, 0x7, 0x4, 0x4, // 4
+  0x7, 0x1, 0x7, 0x4, 0x7, // 5
+  0x7, 0x1, 0x7, 0x5, 0x7, // 6
+  0x7, 0x4, 0x4, 0x2, 0x2, // 7
+  0x7, 0x5, 0x7, 0x5, 0x7, // 8
+  0x7, 0x5, 0x7, 0x4, 0x7, // 9
+  0x0, 0x2, 0x0, 0x2, 0x0, // :
+  0x0, 0x2, 0x0, 0x2, 0x1, // ;
+  0x4, 0x2, 0x1, 0x2, 0x4, // <
+  0x0, 0x7, 0x0, 0x7, 0x0, // =
+  0x1, 0x2, 0x4, 0x2, 0x1, // >
+  0x7, 0x4, 0x6, 0x0, 0x2, // ?
+  0x7, 0x5, 0x5, 0x1, 0x6, // @
+  0x2, 0x5, 0x7, 0x5, 0x5, // A
+  0x3, 0x5, 0x3, 0x5, 0x3, // B
+  0x6, 0x1, 0x1, 0x1, 0x6, // C
+  0x3, 0x5, 0x5, 0x5, 0x3, // D
+  0x7, 0x1, 0x3, 0x1, 0x7, // E
+  0x7, 0x1, 0x3, 0x1, 0x1, // F
+  0x6, 0x1, 0x5, 0x5, 0x6, // G
+  0x5, 0x5, 0x7, 0x5, 0x5, // H
+  0x7, 0x2, 0x2, 0x2, 0x7, // I
+  0x4, 0x4, 0x4, 0x5, 0x2, // J
+  0x5, 0x5, 0x3, 0x5, 0x5, // K
+  0x1, 0x1, 0x1, 0x1, 0x7, // L
+  0x5, 0x7, 0x7, 0x5, 0x5, // M
+  0x3, 0x5, 0x5, 0x5, 0x5, // N
+  0x2, 0x5, 0x5, 0x5, 0x2, // O
+  0x3, 0x5, 0x3, 0x1, 0x1, // P
+  0x2, 0x5, 0x5, 0x3, 0x6, // Q
+  0x3, 0x5, 0x3, 0x5, 0x5, // R
+  0x6, 0x1, 0x2, 0x4, 0x3, // S
+  0x7, 0x2, 0x2, 0x2, 0x2, // T
+  0x5, 0x5, 0x5, 0x5, 0x7, // U
+  0x5, 0x5, 0x5, 0x5, 0x2, // V
+  0x5, 0x5, 0x7, 0x7, 0x5, // W
+  0x5, 0x5, 0x2, 0x5, 0x5, // X
+  0x5, 0x5, 0x2, 0x2, 0x2, // Y
+  0x7, 0x4, 0x2, 0x1, 0x7, // Z
+  0x6, 0x2, 0x2, 0x2, 0x6, // [
+  0x1, 0x1, 0x2, 0x4, 0x4, // backslash
+  0x3, 0x2, 0x2, 0x2, 0x3, // ]
+  0x2, 0x5, 0x0, 0x0, 0x0, // ^
+  0x0, 0x0, 0x0, 0x0, 0x7, // _
+  0x1, 0x2, 0x0, 0x0, 0x0, // `
+  0x0, 0x6, 0x5, 0x5, 0x6, // a
+  0x1, 0x3, 0x5, 0x5, 0x3, // b
+  0x0, 0x6, 0x1, 0x1, 0x6, // c
+  0x4, 0x6, 0x5, 0x5, 0x6, // d
+  0x0, 0x6, 0x7, 0x1, 0x6, // e
+  0x4, 0x2, 0x7, 0x2, 0x2, // f
+  0x0, 0x6, 0x5, 0x6, 0x3, // g
+  0x1, 0x3, 0x5, 0x5, 0x5, // h
+  0x2, 0x0, 0x2, 0x2, 0x2, // i
+  0x4, 0x0, 0x4, 0x5, 0x2, // j
+  0x1, 0x5, 0x3, 0x3, 0x5, // k
+  0x3, 0x2, 0x2, 0x2, 0x7, // l
+  0x0, 0x3, 0x7, 0x7, 0x5, // m
+  0x0, 0x3, 0x5, 0x5, 0x5, // n
+  0x0, 0x2, 0x5, 0x5, 0x2, // o
+  0x0, 0x3, 0x5, 0x3, 0x1, // p
+  0x0, 0x6, 0x5, 0x6, 0x4, // q
+  0x0, 0x6, 0x1, 0x1, 0x1, // r
+  0x0, 0x6, 0x3, 0x4, 0x3, // s
+  0x2, 0x7, 0x2, 0x2, 0x4, // t
+  0x0, 0x5, 0x5, 0x5, 0x6, // u
+  0x0, 0x5, 0x5, 0x5, 0x2, // v
+  0x0, 0x5, 0x7, 0x7, 0x2, // w
+  0x0, 0x5, 0x2, 0x2, 0x5, // x
+  0x0, 0x5, 0x5, 0x2, 0x1, // y
+  0x0, 0x7, 0x2, 0x1, 0x7, // z
+  0x4, 0x2, 0x3, 0x2, 0x4, // {
+  0x2, 0x2, 0x2, 0x2, 0x2, // |
+  0x1, 0x2, 0x6, 0x2, 0x1, // }
+  0x0, 0x6, 0x3, 0x0, 0x0, // ~
+  };
+}
+
+const Font gbx::defaultFont = { 3, 5, 1, ' ', 95, defaultGlyphs };
+
+Label::Label(int16_t originX, int16_t originY) :
+  Renderable(originX, originY),
+  font(&gbx::defaultFont)
+{
+  text[0] = '\0';
+}
+
+void Label::setText(const char* text)
+{
+  if (strncmp(this->text, text, LABEL_CAPACITY) == 0)
+  {
+    return;
+  }
+
+  strncpy(this->text, text, LABEL_CAPACITY);
+  this->text[LABEL_CAPACITY] = '\0';
+  rasterize();
+}
+
+void Label::setInt(int32_t value, uint8_t minDigits)
+{
+  setText(gbx::formatInt(value, minDigits));
+}
+
+void Label::setFont(const Font& font)
+{
+  this->font = &font;
+  rasterize();
+}
+
+void Label::setAlign(uint8_t align)
+{
+  this->align = align;
+}
+
+void Label::rasterize()
+{
+  height = font->height < LABEL_MAX_HEIGHT ? font->height : LABEL_MAX_HEIGHT;
+  memset(rows, 0, sizeof(rows));
+
+  uint8_t x = 0;
+  for (const char* chr = text; *chr != '\0' && x + font->width <= 64; chr++)
+  {
+    uint8_t index = (uint8_t)*chr - font->firstChar;
+    if (index < font->charCount)
+    {
+      const uint8_t* glyph = font->glyphs + index * font->height;
+      for (uint8_t row = 0; row < height; row++)
+      {
+        uint64_t bits = (uint64_t)pgm_read_byte(glyph + row) << x;
+        rows[row][0] |= (uint32_t)bits;
+        rows[row][1] |= (uint32_t)(bits >> 32);
+      }
+    }
+    x += font->width + font->spacing;
+  }
+
+  width = x > 0 ? x - font->spacing : 0;
+}
+
+void Label::draw(int16_t x, int16_t y)
+{
+  x += originX;
+  y += originY;
+  if (align != ALIGN_LEFT)
+  {
+    x -= align == ALIGN_CENTER ? width / 2 : width;
+  }
+
+  for (uint8_t row = 0; row < height; row++)
+  {
+    screen.drawMask(x, y + row, rows[row][0], color);
+    screen.drawMask(x + 32, y + row, rows[row][1], color);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Rect
+//-----------------------------------------------------------------------------
+
+Rect Rect::intersection(const Rect& other) const
+{
+  int16_t left = x > other.x ? x : other.x;
+  int16_t top = y > other.y ? y : other.y;
+  int16_t right = x + w < other.x + other.w ? x + w : other.x + other.w;
+  int16_t bottom = y + h < other.y + other.h ? y + h : other.y + other.h;
+  Rect result = { left, top, (int16_t)(right - left), (int16_t)(bottom - top) };
+  return result;
+}
+
+Rect Rect::merge(const Rect& other) const
+{
+  if (isEmpty())
+  {
+    return other;
+  }
+  if (other.isEmpty())
+  {
+    return *this;
+  }
+
+  int16_t left = x < other.x ? x : other.x;
+  int16_t top = y < other.y ? y : other.y;
+  int16_t right = x + w > other.x + other.w ? x + w : other.x + other.w;
+  int16_t bottom = y + h > other.y + other.h ? y + h : other.y + other.h;
+  Rect result = { left, top, (int16_t)(right - left), (int16_t)(bottom - top) };
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+// Canvas
+//-----------------------------------------------------------------------------
+
+Canvas::Canvas(uint16_t* buffer, int16_t width, int16_t height) :
+  buffer(buffer),
+  width(width),
+  height(height)
+{
+  bounds = { 0, 0, width, height };
+  resetClip();
+}
+
+void Canvas::setBuffer(uint16_t* buffer, const Rect& bounds)
+{
+  this->buffer = buffer;
+  this->bounds = bounds;
+  resetClip();
+}
+
+void Canvas::setClip(const Rect& rect)
+{
+  clip = bounds.intersection(rect);
+}
+
+void Canvas::resetClip()
+{
+  clip = bounds;
+}
+
+void Canvas::clear(Color c)
+{
+  fillRect(clip.x, clip.y, clip.w, clip.h, c);
+}
+
+Color Canvas::getPixel(int16_t x, int16_t y) const
+{
+  if (x >= bounds.x && x < bounds.x + bounds.w && y >= bounds.y && y < bounds.y + bounds.h)
+  {
+    return (Color)*getAddress(x, y);
+  }
+  return Color::black;
+}
+
+void Canvas::drawLine(int16_t x0, int16_t y0, int16_t x1, int16_t y1, Color c)
+{
+  if (y0 == y1)
+  {
+    fillRect(x0 < x1 ? x0 : x1, y0, abs(x1 - x0) + 1, 1, c);
+    return;
+  }
+  if (x0 == x1)
+  {
+    fillRect(x0, y0 < y1 ? y0 : y1, 1, abs(y1 - y0) + 1, c);
+    return;
+  }
+
+  // Bresenham
+  int16_t dx = abs(x1 - x0);
+  int16_t dy = -abs(y1 - y0);
+  int16_t sx = x0 < x1 ? 1 : -1;
+  int16_t sy = y0 < y1 ? 1 : -1;
+  int16_t error = dx + dy;
+  while (true)
+  {
+    setPixel(x0, y0, c);
+    if (x0 == x1 && y0 == y1)
+    {
+      return;
+    }
+    int16_t e2 = 2 * error;
+    if (e2 >= dy)
+    {
+      error += dy;
+      x0 += sx;
+    }
+    if (e2 <= dx)
+    {
+      error += dx;
+      y0 += sy;
+    }
+  }
+}
+
+void Canvas::drawCircle(int16_t x, int16_t y, int16_t r, Color c)
+{
+  // midpoint circle, one octant mirrored 8 times
+  int16_t dx = r;
+  int16_t dy = 0;
+  int16_t error = 1 - r;
+  while (dx >= dy)
+  {
+    setPixel(x + dx, y + dy, c);
+    setPixel(x - dx, y + dy, c);
+    setPixel(x + dx, y - dy, c);
+    setPixel(x - dx, y - dy, c);
+    setPixel(x + dy, y + dx, c);
+    setPixel(x - dy, y + dx, c);
+    setPixel(x + dy, y - dx, c);
+    setPixel(x - dy, y - dx, c);
+    dy++;
+    if (error < 0)
+    {
+      error += 2 * dy + 1;
+    }
+    else
+    {
+      dx--;
+      error += 2 * (dy - dx) + 1;
+    }
+  }
+}
+
+void Canvas::fillCircle(int16_t x, int16_t y, int16_t r, Color c)
+{
+  int16_t dx = r;
+  int16_t dy = 0;
+  int16_t error = 1 - r;
+  while (dx >= dy)
+  {
+    fillRect(x - dx, y + dy, 2 * dx + 1, 1, c);
+    fillRect(x - dx, y - dy, 2 * dx + 1, 1, c);
+    fillRect(x - dy, y + dx, 2 * dy + 1, 1, c);
+    fillRect(x - dy, y - dx, 2 * dy + 1, 1, c);
+    dy++;
+    if (error < 0)
+    {
+      error += 2 * dy + 1;
+    }
+    else
+    {
+      dx--;
+      error += 2 * (dy - dx) + 1;
+    }
+  }
+}
+
+void Canvas::setPixel(int16_t x, int16_t y, Color c)
+{
+  if (x >= clip.x && x < clip.x + clip.w && y >= clip.y && y < clip.y + clip.h)
+  {
+    *getAddress(x, y) = (uint16_t)c;
+  }
+}
+
+void Canvas::fillRect(int16_t x, int16_t y, int16_t w, int16_t h, Color c)
+{
+  Rect rect = { x, y, w, h };
+  rect = rect.intersection(clip);
+  if (rect.isEmpty())
+  {
+    return;
+  }
+
+  uint16_t* row = getAddress(rect.x, rect.y);
+  for (int16_t iy = 0; iy < rect.h; iy++)
+  {
+    for (int16_t ix = 0; ix < rect.w; ix++)
+    {
+      row[ix] = (uint16_t)c;
+    }
+    row += width;
+  }
+}
+
+void Canvas::drawRect(int16_t x, int16_t y, int16_t w, int16_t h, Color c)
+{
+  fillRect(x, y, w, 1, c);
+  fillRect(x, y + h - 1, w, 1, c);
+  fillRect(x, y + 1, 1, h - 2, c);
+  fillRect(x + w - 1, y + 1, 1, h - 2, c);
+}
+
+void Canvas::drawMask(int16_t x, int16_t y, uint32_t mask, Color c)
+{
+  int16_t right = clip.x + clip.w;
+  if (mask == 0 || y < clip.y || y >= clip.y + clip.h || x >= right || x <= clip.x - 32)
+  {
+    return;
+  }
+
+  if (x < clip.x)
+  {
+    mask >>= clip.x - x;
+    x = clip.x;
+  }
+
+  if (right - x < 32)
+  {
+    mask &= (1ul << (right - x)) - 1;
+  }
+
+  for (uint16_t* dest = getAddress(x, y); mask != 0; mask >>= 1, dest++)
+  {
+    if (mask & 1)
+    {
+      *dest = (uint16_t)c;
+    }
+  }
+}
+
+void Canvas::drawText(int16_t x, int16_t y, const char* str, Color c, uint8_t align, const Font& font)
+{
+  // '\n' starts a new line under the previous one, each line is aligned on x
+  uint8_t advance = font.width + font.spacing;
+  for (const char* line = str; ; line++, y += font.height + 1)
+  {
+    const char* end = line;
+    while (*end != '\0' && *end != '\n')
+    {
+      end++;
+    }
+
+    int16_t left = x;
+    if (align != ALIGN_LEFT && end > line)
+    {
+      uint16_t w = (end - line) * advance - font.spacing;
+      left -= align == ALIGN_CENTER ? w / 2 : w;
+    }
+
+    for (; line < end; line++, left += advance)
+    {
+      uint8_t index = (uint8_t)*line - font.firstChar;
+      if (index < font.charCount)
+      {
+        const uint8_t* glyph = font.glyphs + index * font.height;
+        for (uint8_t row = 0; row < font.height; row++)
+        {
+          drawMask(left, y + row, pgm_read_byte(glyph + row), c);
+        }
+      }
+    }
+
+    if (*line == '\0')
+    {
+      return;
+    }
+  }
+}
+
+void Canvas::drawBuffer(int16_t x, int16_t y, const uint16_t* source, int16_t w, int16_t h, uint16_t transparentColor)
+{
+  Rect rect = { x, y, w, h };
+  rect = rect.intersection(clip);
+  if (rect.isEmpty())
+  {
+    return;
+  }
+
+  source += (rect.y - y) * w + rect.x - x;
+  uint16_t* dest = getAddress(rect.x, rect.y);
+  for (int16_t iy = 0; iy < rect.h; iy++)
+  {
+    for (int16_t ix = 0; ix < rect.w; ix++)
+    {
+      if (source[ix] != transparentColor)
+      {
+        dest[ix] = source[ix];
+      }
+    }
+    source += w;
+    dest += width;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// UI
+//-----------------------------------------------------------------------------
+
+Widget::Widget(int16_t x, int16_t y, int16_t width, int16_t height)
+{
+  bounds.x = x;
+  bounds.y = y;
+  bounds.w = width;
+  bounds.h = height;
+}
+
+void Widget::add(Widget& child)
+{
+  Widget** last = &firstChild;
+  while (*last != NULL)
+  {
+    last = &(*last)->nextSibling;
+  }
+  *last = &child;
+  child.invalidate();
+}
+
+void Widget::invalidate()
+{
+  dirty = true;
+}
+
+void Widget::setPosition(int16_t x, int16_t y)
+{
+  if (x != bounds.x || y != bounds.y)
+  {
+    bounds.x = x;
+    bounds.y = y;
+    invalidate();
+  }
+}
+
+void Widget::setVisible(bool visible)
+{
+  if (visible != this->visible)
+  {
+    this->visible = visible;
+    invalidate();
+  }
+}
+
+WidgetLayer::WidgetLayer(int16_t x, int16_t y, int16_t width, int16_t height) :
+  Renderable(x, y),
+  canvas((uint16_t*)malloc(width * height * sizeof(uint16_t)), width, height)
+{
+  if (canvas.buffer != NULL)
+  {
+    canvas.fillRect(0, 0, width, height, (Color)WIDGET_TRANSPARENT_COLOR);
+  }
+}
+
+WidgetLayer::~WidgetLayer()
+{
+  free(canvas.buffer);
+}
+
+void WidgetLayer::add(Widget& widget)
+{
+  Widget** last = &firstChild;
+  while (*last != NULL)
+  {
+    last = &(*last)->nextSibling;
+  }
+  *last = &widget;
+  widget.invalidate();
+}
+
+void WidgetLayer::addDirty(const Rect& rect)
+{
+  if (rect.isEmpty())
+  {
+    return;
+  }
+
+  if (dirtyCount == WIDGET_MAX_DIRTY_RECTS)
+  {
+    dirtyRects[dirtyCount - 1] = dirtyRects[dirtyCount - 1].merge(rect);
+    return;
+  }
+
+  dirtyRects[dirtyCount++] = rect;
+}
+
+void WidgetLayer::collectDirty(Widget* widget, bool parentVisible, bool parentDirty)
+{
+  for (; widget != NULL; widget = widget->nextSibling)
+  {
+    // children may lie outside of their parent, they follow its changes
+    bool visible = parentVisible && widget->visible;
+    bool dirty = parentDirty || widget->dirty;
+    if (dirty)
+    {
+      // repaint where the widget was and where it is now
+      addDirty(widget->paintedBounds);
+      if (visible)
+      {
+        addDirty(widget->bounds);
+      }
+      widget->paintedBounds = visible ? widget->bounds : Rect();
+      widget->dirty = false;
+    }
+    collectDirty(widget->firstChild, visible, dirty);
+  }
+}
+
+void WidgetLayer::paint(Widget* widget, Canvas& target, const Rect& rect)
+{
+  for (; widget != NULL; widget = widget->nextSibling)
+  {
+    if (widget->visible)
+    {
+      if (widget->bounds.intersects(rect))
+      {
+        widget->paint(target);
+      }
+      paint(widget->firstChild, target, rect);
+    }
+  }
+}
+
+void WidgetLayer::draw(int16_t x, int16_t y)
+{
+  if (canvas.buffer == NULL)
+  {
+    // no cache, paint through a canvas mapping the layer onto the screen
+    Rect area = { originX, originY, canvas.width, canvas.height };
+    area = area.intersection(screen.getClip());
+    if (area.isEmpty())
+    {
+      return;
+    }
+    uint16_t* pixels = screen.getAddress(area.x, area.y);
+    area.x -= originX;
+    area.y -= originY;
+    Canvas direct;
+    direct.width = screen.width;
+    direct.height = canvas.height;
+    direct.setBuffer(pixels, area);
+    paint(firstChild, direct, area);
+    return;
+  }
+
+  dirtyCount = 0;
+  collectDirty(firstChild, true, false);
+
+  for (uint8_t i = 0; i < dirtyCount; i++)
+  {
+    canvas.setClip(dirtyRects[i]);
+    canvas.fillRect(0, 0, canvas.width, canvas.height, (Color)WIDGET_TRANSPARENT_COLOR);
+    paint(firstChild, canvas, canvas.getClip());
+  }
+  canvas.resetClip();
+
+  // widgets are drawn in screen space, the camera offset is ignored
+  screen.drawBuffer(originX, originY, canvas.buffer, canvas.width, canvas.height, WIDGET_TRANSPARENT_COLOR);
+}
+
+void PanelWidget::setColors(Color background, Color border)
+{
+  if (background != this->background || border != this->border)
+  {
+    this->background = background;
+    this->border = border;
+    invalidate();
+  }
+}
+
+void PanelWidget::paint(Canvas& canvas)
+{
+  canvas.fillRect(bounds.x, bounds.y, bounds.w, bounds.h, background);
+  if (border != background)
+  {
+    canvas.drawRect(bounds.x, bounds.y, bounds.w, bounds.h, border);
+  }
+}
+
+LabelWidget::LabelWidget(int16_t x, int16_t y, int16_t width, const char* text, Color color) :
+  Widget(x, y, width, gbx::defaultFont.height),
+  color(color)
+{
+  this->text[0] = '\0';
+  setText(text);
+}
+
+void LabelWidget::setText(const char* text)
+{
+  if (strncmp(this->text, text, LABEL_CAPACITY) != 0)
+  {
+    strncpy(this->text, text, LABEL_CAPACITY);
+    this->text[LABEL_CAPACITY] = '\0';
+    invalidate();
+  }
+}
+
+void LabelWidget::setInt(int32_t value, uint8_t minDigits)
+{
+  setText(gbx::formatInt(value, minDigits));
+}
+
+void LabelWidget::setColor(Color color)
+{
+  if (color != this->color)
+  {
+    this->color = color;
+    invalidate();
+  }
+}
+
+void LabelWidget::setAlign(uint8_t align)
+{
+  if (align != this->align)
+  {
+    this->align = align;
+    invalidate();
+  }
+}
+
+void LabelWidget::paint(Canvas& canvas)
+{
+  int16_t x = bounds.x;
+  if (align == ALIGN_CENTER)
+  {
+    x += bounds.w / 2;
+  }
+  else if (align == ALIGN_RIGHT)
+  {
+    x += bounds.w;
+  }
+  canvas.drawText(x, bounds.y, text, color, align);
+}
+
+void BarWidget::setValue(uint16_t value, uint16_t max)
+{
+  // only repaint when the filled width actually changes
+  int16_t w = max > 0 ? (uint32_t)(value < max ? value : max) * bounds.w / max : 0;
+  if (w != fillWidth)
+  {
+    fillWidth = w;
+    invalidate();
+  }
+}
+
+void BarWidget::paint(Canvas& canvas)
+{
+  canvas.fillRect(bounds.x, bounds.y, fillWidth, bounds.h, fill);
+  canvas.fillRect(bounds.x + fillWidth, bounds.y, bounds.w - fillWidth, bounds.h, background);
+}
+
+void ListWidget::setItems(const char* const* items, uint8_t count)
+{
+  this->items = items;
+  this->count = count;
+  selected = 0;
+  scroll = 0;
+  invalidate();
+}
+
+void ListWidget::setSelected(uint8_t index)
+{
+  if (index >= count || index == selected)
+  {
+    return;
+  }
+
+  selected = index;
+  uint8_t rows = bounds.h / (gbx::defaultFont.height + 1);
+  if (selected < scroll)
+  {
+    scroll = selected;
+  }
+  else if (rows > 0 && selected >= scroll + rows)
+  {
+    scroll = selected - rows + 1;
+  }
+  invalidate();
+}
+
+void ListWidget::selectNext()
+{
+  setSelected(selected + 1 < count ? selected + 1 : 0);
+}
+
+void ListWidget::selectPrevious()
+{
+  setSelected(selected > 0 ? selected - 1 : count - 1);
+}
+
+void ListWidget::paint(Canvas& canvas)
+{
+  uint8_t lineHeight = gbx::defaultFont.height + 1;
+  int16_t y = bounds.y;
+  for (uint8_t i = scroll; i < count && y + lineHeight <= bounds.y + bounds.h; i++, y += lineHeight)
+  {
+    if (i == selected)
+    {
+      canvas.drawText(bounds.x, y, ">", selectedColor);
+    }
+    canvas.drawText(bounds.x + 4, y, items[i], i == selected ? selectedColor : color);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Entity
+//-----------------------------------------------------------------------------
+
+void Entity::_init(int16_t x, int16_t y)
+{
+  this->x = x;
+  this->y = y;
+  flags = _FLAG_ACTIVE | FLAG_COLLIDABLE | FLAG_VISIBLE;
+  generation++;
+  entityCount++;
+  onInit();
+  updateBounds();
+}
+
+#if SAVE_STATES
+void Entity::_save(StateWriter& out)
+{
+  out.writeValue(x);
+  out.writeValue(y);
+  out.writeValue(flags);
+  onSaveState(out);
+}
+
+void Entity::_load(StateReader& in)
+{
+  int16_t x;
+  int16_t y;
+  uint8_t flags;
+  in.readValue(x);
+  in.readValue(y);
+  in.readValue(flags);
+  if (!getFlag(_FLAG_ACTIVE))
+  {
+    // spawned since the save
+    _init(x, y);
+  }
+
+  this->x = x;
+  this->y = y;
+  this->flags = flags | _FLAG_ACTIVE;
+  updateBounds();
+  onLoadState(in);
+}
+
+void Entity::_deactivate()
+{
+  if (getFlag(_FLAG_ACTIVE))
+  {
+    flags &= ~_FLAG_ACTIVE;
+    entityCount--;
+  }
+}
+#endif
+
+void Entity::remove()
+{
+  _pool->remove(this);
+  entityCount--;
+}
+
+uint8_t Entity::getType()
+{
+  return _pool->getType();
+}
+
+void Entity::drawDebug(int16_t x, int16_t y)
+{
+  gbx::drawRect(x + hitboxX, y + hitboxY, hitboxWidth, hitboxHeight, Color::lightblue);
+  gbx::setPixel(x, y, Color::red);
+}
+
+bool Entity::collide(int16_t x, int16_t y, uint16_t w, uint16_t h) const
+{
+  int16_t left = Entity::x + hitboxX;
+  int16_t top = Entity::y + hitboxY;
+  return left < x + (int16_t)w && x < left + hitboxWidth && top < y + (int16_t)h && y < top + hitboxHeight;
+}
+
+Entity* Entity::query(int16_t x, int16_t y, const uint8_t collideTypeIds[]) const
+{
+#if COLLISION_STATS
+  uint8_t type = _pool->getType();
+  querierType = type < COLLISION_STATS_TYPES ? type : QUERIER_NONE;
+  Entity* entity = gbx::getScene().query(x + hitboxX, y + hitboxY, hitboxWidth, hitboxHeight, collideTypeIds);
+  querierType = QUERIER_NONE;
+  return entity;
+#else
+  return gbx::getScene().query(x + hitboxX, y + hitboxY, hitboxWidth, hitboxHeight, collideTypeIds);
+#endif
+}
+
+void Entity::moveBy(int16_t dx, int16_t dy, const uint8_t collideTypeIds[])
+{
+  if (collideTypeIds == NULL)
+  {
+    x += dx;
+    y += dy;
+    updateBounds();
+    return;
+  }
+
+  if (dx != 0)
+  {
+    int16_t sign = dx < 0 ? -1 : 1;
+    int16_t dist = dx * sign;
+    while (dist > 0)
+    {
+      Entity* other = query(x + sign, y, collideTypeIds);
+      if (other != NULL && onMoveCollideX(*other))
+      {
+        break;
+      }
+      dist--;
+      x += sign;
+    }
+  }
+
+  if (dy != 0)
+  {
+    int16_t sign = dy < 0 ? -1 : 1;
+    int16_t dist = dy * sign;
+    while (dist > 0)
+    {
+      Entity* other = query(x, y + sign, collideTypeIds);
+      if (other != NULL && onMoveCollideY(*other))
+      {
+        break;
+      }
+      dist--;
+      y += sign;
+    }
+  }
+  updateBounds();
+}
+
+void Entity::moveTo(int16_t x, int16_t y, const uint8_t collideTypeIds[])
+{
+  moveBy(x - Entity::x, y - Entity::y, collideTypeIds);
+}
+
+//-----------------------------------------------------------------------------
+// DataPool
+//-----------------------------------------------------------------------------
+
+DataPool::DataPool(IScene* scene, uint8_t type, uint16_t size, uint8_t layer) :
+  type(type),
+  layer(layer)
+{
+  handle._pool = this;
+  handle.setFlag(_FLAG_ACTIVE | FLAG_COLLIDABLE | FLAG_VISIBLE, true);
+  scene->_addPool(this);
+  init(size);
+}
+
+DataPool::~DataPool()
+{
+  free(x);
+  free(y);
+  free(vx);
+  free(vy);
+  free(frame);
+  free(state);
+}
+
+bool DataPool::init(uint16_t size)
+{
+  clear();
+  free(x);
+  free(y);
+  free(vx);
+  free(vy);
+  free(frame);
+  free(state);
+
+  x = (int16_t*)malloc(size * sizeof(int16_t));
+  y = (int16_t*)malloc(size * sizeof(int16_t));
+  vx = (int16_t*)malloc(size * sizeof(int16_t));
+  vy = (int16_t*)malloc(size * sizeof(int16_t));
+  frame = (uint8_t*)malloc(size);
+  state = (uint8_t*)malloc(size);
+  if (x == NULL || y == NULL || vx == NULL || vy == NULL || frame == NULL || state == NULL)
+  {
+    free(x);
+    free(y);
+    free(vx);
+    free(vy);
+    free(frame);
+    free(state);
+    x = NULL;
+    y = NULL;
+    vx = NULL;
+    vy = NULL;
+    frame = NULL;
+    state = NULL;
+    this->size = 0;
+    return false;
+  }
+
+  this->size = size;
+  return true;
+}
+
+int16_t DataPool::spawn(int16_t x, int16_t y)
+{
+  if (count == size)
+  {
+    return -1;
+  }
+
+  this->x[count] = x;
+  this->y[count] = y;
+  vx[count] = 0;
+  vy[count] = 0;
+  frame[count] = 0;
+  state[count] = 0;
+  entityCount++;
+  return count++;
+}
+
+void DataPool::remove(uint16_t index)
+{
+  if (index >= count)
+  {
+    return;
+  }
+
+  count--;
+  x[index] = x[count];
+  y[index] = y[count];
+  vx[index] = vx[count];
+  vy[index] = vy[count];
+  frame[index] = frame[count];
+  state[index] = state[count];
+  entityCount--;
+}
+
+void DataPool::remove(Entity* entity)
+{
+  // Entity::remove() already counted the removal
+  if (entity == &handle && handleIndex >= 0)
+  {
+    remove((uint16_t)handleIndex);
+    entityCount++;
+    handleIndex = -1;
+  }
+}
+
+void DataPool::clear()
+{
+  entityCount -= count;
+  count = 0;
+}
+
+bool DataPool::addSystem(System system)
+{
+  if (systemCount == DATA_POOL_MAX_SYSTEMS)
+  {
+    return false;
+  }
+  systems[systemCount++] = system;
+  return true;
+}
+
+#if SAVE_STATES
+void DataPool::saveState(StateWriter& out)
+{
+  out.writeValue(count);
+  out.write(x, count * sizeof(int16_t));
+  out.write(y, count * sizeof(int16_t));
+  out.write(vx, count * sizeof(int16_t));
+  out.write(vy, count * sizeof(int16_t));
+  out.write(frame, count);
+  out.write(state, count);
+}
+
+void DataPool::loadState(StateReader& in)
+{
+  uint16_t count;
+  in.readValue(count);
+  if (count > size)
+  {
+    in.fail();
+    return;
+  }
+
+  entityCount += count - this->count;
+  this->count = count;
+  in.read(x, count * sizeof(int16_t));
+  in.read(y, count * sizeof(int16_t));
+  in.read(vx, count * sizeof(int16_t));
+  in.read(vy, count * sizeof(int16_t));
+  in.read(frame, count);
+  in.read(state, count);
+}
+#endif
+
+void DataPool::setHitbox(int8_t x, int8_t y, uint8_t width, uint8_t height)
+{
+  handle.setHitbox(x, y, width, height);
+}
+
+void DataPool::update(const Rect& view)
+{
+  for (uint8_t i = 0; i < systemCount; i++)
+  {
+    systems[i](*this);
+  }
+}
+
+void DataPool::applyVelocity(DataPool& pool)
+{
+  for (uint16_t i = 0; i < pool.count; i++)
+  {
+    pool.x[i] += pool.vx[i];
+    pool.y[i] += pool.vy[i];
+  }
+}
+
+void DataPool::draw(int16_t x, int16_t y)
+{
+  if (sprite == NULL)
+  {
+    return;
+  }
+
+  // positions whose sprite overlaps the view
+  const Rect& view = gbx::getView();
+  int16_t left = view.x - sprite->originX - sprite->getWidth() + 1;
+  int16_t top = view.y - sprite->originY - sprite->getHeight() + 1;
+  int16_t right = view.x + view.w - sprite->originX;
+  int16_t bottom = view.y + view.h - sprite->originY;
+  for (uint16_t i = 0; i < count; i++)
+  {
+    int16_t drawX = this->x[i] + x;
+    int16_t drawY = this->y[i] + y;
+    if (drawX >= left && drawX < right && drawY >= top && drawY < bottom)
+    {
+      sprite->frame = frame[i];
+      sprite->draw(drawX, drawY);
+    }
+  }
+}
+
+void DataPool::drawDebug(int16_t x, int16_t y)
+{
+  for (uint16_t i = 0; i < count; i++)
+  {
+    handle.drawDebug(this->x[i] + x, this->y[i] + y);
+  }
+}
+
+Entity* DataPool::query(int16_t x, int16_t y, uint16_t w, uint16_t h)
+{
+  int16_t left = handle.hitboxX;
+  int16_t top = handle.hitboxY;
+  int16_t width = handle.hitboxWidth;
+  int16_t height = handle.hitboxHeight;
+  for (uint16_t i = 0; i < count; i++)
+  {
+    int16_t hitX = this->x[i] + left;
+    int16_t hitY = this->y[i] + top;
+    if (hitX < x + (int16_t)w && hitX + width > x && hitY < y + (int16_t)h && hitY + height > y)
+    {
+#if COLLISION_STATS
+      gbx::_countQuery(type, i + 1, true);
+#endif
+      handle.x = this->x[i];
+      handle.y = this->y[i];
+      handleIndex = i;
+      return &handle;
+    }
+  }
+
+#if COLLISION_STATS
+  gbx::_countQuery(type, count, false);
+#endif
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Trigger
+//-----------------------------------------------------------------------------
+
+void Trigger::check(IEntityPool& pool, bool silent)
+{
+  int16_t right = x + w;
+  int16_t bottom = y + h;
+
+  // exits first so the freed slots can take new occupants
+  uint8_t i = 0;
+  while (i < occupantCount)
+  {
+    Entity* entity = occupants[i];
+    if (!entity->getFlag(_FLAG_ACTIVE) || entity->getGeneration() != generations[i] ||
+      !entity->getFlag(FLAG_COLLIDABLE) || !entity->overlaps(x, y, right, bottom))
+    {
+      occupantCount--;
+      occupants[i] = occupants[occupantCount];
+      generations[i] = generations[occupantCount];
+      if (!silent)
+      {
+        onExit(*entity);
+      }
+      continue;
+    }
+    i++;
+  }
+
+  overflowed = false;
+  if (pool.getCount() == 0)
+  {
+    return;
+  }
+
+  // the occupants take at most half of the hits kept, the rest is enough to
+  // fill the free slots
+  Entity* found[2 * TRIGGER_MAX_OCCUPANTS];
+  uint16_t hits = pool.queryAll(x, y, w, h, found, 2 * TRIGGER_MAX_OCCUPANTS);
+  uint8_t kept = hits < 2 * TRIGGER_MAX_OCCUPANTS ? hits : 2 * TRIGGER_MAX_OCCUPANTS;
+  for (uint8_t k = 0; k < kept && occupantCount < TRIGGER_MAX_OCCUPANTS; k++)
+  {
+    Entity* entity = found[k];
+    bool inside = false;
+    for (uint8_t j = 0; j < occupantCount; j++)
+    {
+      if (occupants[j] == entity)
+      {
+        inside = true;
+        break;
+      }
+    }
+    if (!inside)
+    {
+      occupants[occupantCount] = entity;
+      generations[occupantCount] = entity->getGeneration();
+      occupantCount++;
+      if (!silent)
+      {
+        onEnter(*entity);
+      }
+    }
+  }
+  overflowed = hits > occupantCount;
+}
+
+//-----------------------------------------------------------------------------
+// Scene
+//-----------------------------------------------------------------------------
+
+void Camera::follow(const Entity* target, int16_t offsetX, int16_t offsetY)
+{
+  this->target = target;
+  this->offsetX = offsetX;
+  this->offsetY = offsetY;
+  active = true;
+}
+
+void Camera::moveTo(int16_t x, int16_t y)
+{
+  posX = (int32_t)x << 8;
+  posY = (int32_t)y << 8;
+  clamp();
+  active = true;
+}
+
+void Camera::setDeadzone(uint8_t width, uint8_t height)
+{
+  deadzoneWidth = width;
+  deadzoneHeight = height;
+}
+
+void Camera::setSmoothing(uint16_t smoothing)
+{
+  this->smoothing = smoothing > 0 && smoothing < CAMERA_SNAP ? smoothing : CAMERA_SNAP;
+}
+
+void Camera::setBounds(int16_t x, int16_t y, int16_t w, int16_t h)
+{
+  bounds = { x, y, w, h };
+  clamp();
+}
+
+void Camera::clearBounds()
+{
+  bounds = { 0, 0, 0, 0 };
+}
+
+Rect Camera::getView() const
+{
+  return { getX(), getY(), gbx::width, gbx::height };
+}
+
+void Camera::clamp()
+{
+  if (bounds.isEmpty())
+  {
+    return;
+  }
+
+  // maps smaller than the screen are centered
+  int32_t minX = (int32_t)bounds.x << 8;
+  int32_t maxX = (int32_t)(bounds.x + bounds.w - gbx::width) << 8;
+  posX = maxX < minX ? (minX + maxX) / 2 : (posX < minX ? minX : (posX > maxX ? maxX : posX));
+  int32_t minY = (int32_t)bounds.y << 8;
+  int32_t maxY = (int32_t)(bounds.y + bounds.h - gbx::height) << 8;
+  posY = maxY < minY ? (minY + maxY) / 2 : (posY < minY ? minY : (posY > maxY ? maxY : posY));
+}
+
+bool Camera::update()
+{
+  if (!active)
+  {
+    return false;
+  }
+
+  if (target != NULL)
+  {
+    // smallest move keeping the target inside the deadzone
+    int32_t targetX = (int32_t)(target->x + offsetX) << 8;
+    int32_t targetY = (int32_t)(target->y + offsetY) << 8;
+    int32_t goalX = posX;
+    int32_t goalY = posY;
+    int32_t left = posX + ((int32_t)(gbx::width - deadzoneWidth) << 7);
+    int32_t top = posY + ((int32_t)(gbx::height - deadzoneHeight) << 7);
+    if (targetX < left)
+    {
+      goalX += targetX - left;
+    }
+    else if (targetX > left + (deadzoneWidth << 8))
+    {
+      goalX += targetX - left - (deadzoneWidth << 8);
+    }
+    if (targetY < top)
+    {
+      goalY += targetY - top;
+    }
+    else if (targetY > top + (deadzoneHeight << 8))
+    {
+      goalY += targetY - top - (deadzoneHeight << 8);
+    }
+
+    posX += (goalX - posX) * smoothing >> 8;
+    posY += (goalY - posY) * smoothing >> 8;
+    clamp();
+  }
+  return true;
+}
+
+Scene::Scene() :
+  pools(TYPES_INITIAL_CAPACITY),
+  layers(LAYERS_INITIAL_CAPACITY),
+  triggers(TRIGGERS_INITIAL_CAPACITY)
+{
+}
+
+Scene::~Scene()
+{
+  for (Layer** layer = layers.begin(); layer < layers.end(); layer++)
+  {
+    delete *layer;
+  }
+}
+
+void Scene::init()
+{
+  for (Layer** layer = layers.begin(); layer < layers.end(); layer++)
+  {
+    if (*layer != NULL)
+    {
+      (*layer)->renderables.clear();
+    }
+  }
+  triggers.clear();
+
+  for (IEntityPool** pool = pools.begin(); pool < pools.end(); pool++)
+  {
+    if (*pool != NULL)
+    {
+      add(**pool, (*pool)->getLayer());
+    }
+  }
+
+  onInit();
+}
+
+void Scene::_addPool(IEntityPool * pool)
+{
+  pools[pool->getType()] = pool;
+}
+
+Scene::Layer* Scene::getLayer(uint8_t layer)
+{
+  if (layers[layer] == NULL)
+  {
+    layers[layer] = new Layer();
+  }
+  return layers[layer];
+}
+
+void Scene::add(IRenderable& renderable, uint8_t layer)
+{
+  getLayer(layer)->renderables.add(&renderable);
+}
+
+void Scene::setLayerScroll(uint8_t layer, int16_t scrollX, int16_t scrollY, int16_t offsetX, int16_t offsetY)
+{
+  Layer* l = getLayer(layer);
+  l->scrollX = scrollX;
+  l->scrollY = scrollY;
+  l->offsetX = offsetX;
+  l->offsetY = offsetY;
+}
+
+void Scene::addTrigger(Trigger& trigger)
+{
+  trigger.reset();
+  triggers.add(&trigger);
+}
+
+void Scene::_update()
+{
+  update();
+  tick++;
+}
+
+void Scene::update()
+{
+  Rect view = { cameraX, cameraY, gbx::width, gbx::height };
+  for (IEntityPool** pool = pools.begin(); pool < pools.end(); pool++)
+  {
+    if (*pool != NULL)
+    {
+      PROFILE_BEGIN(pool);
+      (*pool)->update(view);
+      PROFILE_END(pool, PROFILE_POOL((*pool)->getType()));
+    }
+  }
+
+  for (Trigger** trigger = triggers.begin(); trigger < triggers.end(); trigger++)
+  {
+    IEntityPool* pool = getPool((*trigger)->entityType);
+    if (pool != NULL)
+    {
+      (*trigger)->check(*pool);
+    }
+  }
+
+  if (camera.update())
+  {
+    cameraX = camera.getX();
+    cameraY = camera.getY();
+  }
+}
+
+void Scene::draw()
+{
+  if (!gbx::isOverlay())
+  {
+    gbx::clear();
+  }
+
+  for (Layer** layer = layers.begin(); layer < layers.end(); layer++)
+  {
+    if (*layer != NULL)
+    {
+      PROFILE_BEGIN(layer);
+      Layer& l = **layer;
+      int16_t x = l.offsetX - (int16_t)(((int32_t)cameraX * l.scrollX) >> 8);
+      int16_t y = l.offsetY - (int16_t)(((int32_t)cameraY * l.scrollY) >> 8);
+      for (IRenderable** renderable = l.renderables.begin(); renderable < l.renderables.end(); renderable++)
+      {
+        (*renderable)->draw(x, y);
+      }
+      PROFILE_END(layer, PROFILE_LAYER(layer - layers.begin()));
+    }
+  }
+}
+
+void Scene::drawLoading(uint16_t done, uint16_t total)
+{
+  gbx::clear();
+  int16_t w = gbx::width / 2;
+  int16_t x = (gbx::width - w) / 2;
+  int16_t y = gbx::height / 2 - 2;
+  gbx::drawRect(x, y, w, 4);
+  gbx::fillRect(x + 1, y + 1, (int32_t)(w - 2) * done / total, 2);
+}
+
+void Scene::drawDebug()
+{
+  for (IEntityPool** pool = pools.begin(); pool < pools.end(); pool++)
+  {
+    if (*pool != NULL)
+    {
+      (*pool)->drawDebug(-cameraX, -cameraY);
+    }
+  }
+}
+
+IEntityPool* Scene::getPool(uint8_t type)
+{
+  return type < pools.getSize() ? pools[type] : NULL;
+}
+
+#if SAVE_STATES
+bool Scene::saveState(StateWriter& out)
+{
+  uint8_t poolCount = 0;
+  for (IEntityPool** pool = pools.begin(); pool < pools.end(); pool++)
+  {
+    if (*pool != NULL)
+    {
+      poolCount++;
+    }
+  }
+
+  const uint8_t header[] = { 'G', 'B', 'X', 'S', SAVE_VERSION, poolCount, 0, 0 };
+  out.write(header, sizeof(header));
+  out.writeValue(cameraX);
+  out.writeValue(cameraY);
+
+  // the camera target is saved as a pool slot
+  uint8_t targetType = camera.target != NULL ? SAVE_OTHER_TARGET : SAVE_NO_TARGET;
+  uint16_t targetIndex = 0;
+  for (IEntityPool** pool = pools.begin(); pool < pools.end() && targetType == SAVE_OTHER_TARGET; pool++)
+  {
+    uint16_t size = *pool != NULL ? (*pool)->getSize() : 0;
+    for (uint16_t i = 0; i < size; i++)
+    {
+      if ((*pool)->getEntity(i) == camera.target)
+      {
+        targetType = (*pool)->getType();
+        targetIndex = i;
+        break;
+      }
+    }
+  }
+
+  out.writeValue((uint8_t)camera.active);
+  out.writeValue(camera.posX);
+  out.writeValue(camera.posY);
+  out.writeValue(targetType);
+  out.writeValue(targetIndex);
+
+  for (IEntityPool** pool = pools.begin(); pool < pools.end(); pool++)
+  {
+    if (*pool != NULL)
+    {
+      out.writeValue((*pool)->getType());
+      out.writeValue((*pool)->getSize());
+      (*pool)->saveState(out);
+    }
+  }
+
+  onSaveState(out);
+  return !out.hasFailed();
+}
+
+bool Scene::loadState(StateReader& in)
+{
+  uint8_t header[8];
+  in.read(header, sizeof(header));
+  if (memcmp(header, "GBXS", 4) != 0 || header[4] != SAVE_VERSION)
+  {
+    return false;
+  }
+
+  uint8_t active;
+  uint8_t targetType;
+  uint16_t targetIndex;
+  in.readValue(cameraX);
+  in.readValue(cameraY);
+  in.readValue(active);
+  in.readValue(camera.posX);
+  in.readValue(camera.posY);
+  in.readValue(targetType);
+  in.readValue(targetIndex);
+  camera.active = active;
+
+  for (uint8_t i = 0; i < header[5]; i++)
+  {
+    uint8_t type;
+    uint16_t size;
+    in.readValue(type);
+    in.readValue(size);
+    IEntityPool* pool = getPool(type);
+    if (in.hasFailed() || pool == NULL || pool->getSize() != size)
+    {
+      return false;
+    }
+    pool->loadState(in);
+  }
+
+  if (targetType != SAVE_OTHER_TARGET)
+  {
+    IEntityPool* pool = targetType != SAVE_NO_TARGET ? getPool(targetType) : NULL;
+    camera.target = pool != NULL && targetIndex < pool->getSize() ? pool->getEntity(targetIndex) : NULL;
+  }
+
+  // the entities did not move into or out of the triggers, they were placed
+  for (Trigger** trigger = triggers.begin(); trigger < triggers.end(); trigger++)
+  {
+    IEntityPool* pool = getPool((*trigger)->entityType);
+    (*trigger)->reset();
+    if (pool != NULL)
+    {
+      (*trigger)->check(*pool, true);
+    }
+  }
+
+  onLoadState(in);
+  return !in.hasFailed();
+}
+#endif
+
+Entity* Scene::query(int16_t x, int16_t y, uint16_t w, uint16_t h, uint8_t entityType)
+{
+  frameStats.queryCount++;
+
+  if (entityType >= pools.getSize())
+  {
+    return NULL;
+  }
+
+  IEntityPool* pool = pools[entityType];
+  if (pool != NULL)
+  {
+    Entity* entity = pool->query(x, y, w, h);
+    if (entity != NULL)
+    {
+      return entity;
+    }
+  }
+
+  return NULL;
+}
+
+Entity* Scene::query(int16_t x, int16_t y, uint16_t w, uint16_t h, const uint8_t entityTypes[])
+{
+  for (uint8_t i = 1; i <= entityTypes[0]; i++)
+  {
+    Entity* entity = query(x, y, w, h, entityTypes[i]);
+    if (entity != NULL)
+    {
+      return entity;
+    }
+  }
+
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Sprite
+//-----------------------------------------------------------------------------
+
+// TODO add support for horiz/vert flip
+
+void Sprite::init(const uint16_t *data)
+{
+  width = pgm_read_word(data++);
+  height = pgm_read_word(data++);
+  transparentColor = pgm_read_word(data++);
+  buffer = data;
+}
+
+void Sprite::draw(int16_t x, int16_t y)
+{
+  x += this->originX;
+  y += this->originY;
+
+  // crop to the view
+  const Rect& view = gbx::getView();
+  int16_t left = x > view.x ? x : view.x;
+  int16_t top = y > view.y ? y : view.y;
+  int16_t right = x + width < view.x + view.w ? x + width : view.x + view.w;
+  int16_t bottom = y + height < view.y + view.h ? y + height : view.y + view.h;
+  if (left >= right || top >= bottom)
+  {
+    // out of view!
+    return;
+  }
+  int16_t xOffset = left - x;
+  int16_t yOffset = top - y;
+  int16_t renderWidth = right - left;
+  int16_t renderHeight = bottom - top;
+
+  // calculate source and dest pointers initial address
+  const uint16_t* sourcePtr = buffer + (yOffset * width);
+  
+  if (flip)
+  {
+    sourcePtr += width - xOffset - 1;
+  }
+  else
+  {
+    sourcePtr += xOffset;
+  }
+
+  if (frame > 0)
+  {
+    sourcePtr += frame * width * height;
+  }
+  
+  uint16_t* destPtr = screen.getAddress(left, top);
+  frameStats.pixelCount += renderWidth * renderHeight;
+
+  // rendering code
+  if (!flip && !transparentColor)
+  {
+    // no flip, no transparent color, use memcpy
+    for (uint8_t iy = 0; iy < renderHeight; iy++)
+    {
+      memcpy(destPtr, sourcePtr, renderWidth * 2);
+      sourcePtr += width;
+      destPtr += screen.width;
+    }
+  }
+  else if(!flip)
+  {
+    // no flip, transparent color, copy pixel by pixel
+    for (uint8_t iy = 0; iy < renderHeight; iy++)
+    {
+      for (uint8_t ix = 0; ix < renderWidth; ix++)
+      {
+        if (*sourcePtr != transparentColor)
+        {
+          *destPtr = *sourcePtr;
+        }
+        sourcePtr++;
+        destPtr++;
+      }
+      sourcePtr += width - renderWidth;
+      destPtr += screen.width - renderWidth;
+    }
+  }
+  else
+  {
+    // flip, copy pixel by pixel
+    for (uint8_t iy = 0; iy < renderHeight; iy++)
+    {
+      for (uint8_t ix = 0; ix < renderWidth; ix++)
+      {
+        if (!transparentColor || *sourcePtr != transparentColor)
+        {
+          *destPtr = *sourcePtr;
+        }
+        sourcePtr--;
+        destPtr++;
+      }
+      sourcePtr += width + renderWidth;
+      destPtr += screen.width - renderWidth;
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Anim
+//-----------------------------------------------------------------------------
+
+void Anim::init(const uint16_t *spriteData, const uint8_t* animData)
+{
+  sprite.init(spriteData);
+  this->animData = animData;
+  currentAnim = NULL;
+}
+
+void Anim::draw(int16_t x, int16_t y)
+{
+  if (currentAnim == NULL)
+  {
+    return;
+  }
+
+  // advance by the number of updates since the last draw so that skipped
+  // draws do not slow down the animation (play() counts its own update, a
+  // play() from a draw is ahead by one)
+  uint8_t interval = currentAnim[2];
+  if (interval > 0)
+  {
+    uint16_t tick = gbx::getTick();
+    int16_t ticks = tick - lastTick;
+    uint32_t elapsed = counter + (ticks > 0 ? ticks : 0);
+    lastTick = tick;
+
+    uint32_t frameIndex = currentFrameIndex + elapsed / interval;
+    counter = elapsed % interval;
+    if (frameIndex >= currentAnim[0])
+    {
+      if (currentAnim[1] == LOOP)
+      {
+        frameIndex %= currentAnim[0];
+      }
+      else // currentAnim[1] == ONE_SHOT
+      {
+        currentAnim = NULL;
+        return;
+      }
+    }
+    currentFrameIndex = frameIndex;
+  }
+
+  sprite.frame = currentAnim[3 + currentFrameIndex] + frameOffset;
+  sprite.draw(x + this->originX, y + this->originY);
+}
+
+void Anim::play(uint8_t anim)
+{
+  currentAnim = animData;
+  for (uint8_t i = 0; i < anim; i++)
+  {
+    currentAnim += 3 + currentAnim[0];
+  }
+  currentFrameIndex = 0;
+  counter = 0;
+  lastTick = gbx::getTick() + 1; // the tick of the update calling play ends before the draw
+}
+
+//-----------------------------------------------------------------------------
+// Tilemap
+//-----------------------------------------------------------------------------
+
+AnimatedTiles::AnimatedTiles(uint8_t capacity) :
+  entries((Entry*)malloc(capacity * sizeof(Entry))),
+  capacity(entries != NULL ? capacity : 0) // add fails when out of memory
+{
+}
+
+AnimatedTiles::~AnimatedTiles()
+{
+  free(entries);
+  free(current);
+}
+
+bool AnimatedTiles::add(int16_t tile, const int16_t* frames, uint8_t frameCount, uint8_t interval)
+{
+  if (size == capacity || frameCount == 0 || interval == 0)
+  {
+    return false;
+  }
+
+  // grow the lookup table to cover the new tile id
+  int16_t first = tileCount == 0 || tile < firstTile ? tile : firstTile;
+  int16_t last = tileCount == 0 || tile >= firstTile + tileCount ? tile : firstTile + tileCount - 1;
+  int16_t* table = (int16_t*)malloc((last - first + 1) * sizeof(int16_t));
+  if (table == NULL)
+  {
+    return false;
+  }
+  for (int16_t i = first; i <= last; i++)
+  {
+    table[i - first] = get(i);
+  }
+  free(current);
+  current = table;
+  firstTile = first;
+  tileCount = last - first + 1;
+
+  Entry& entry = entries[size++];
+  entry.tile = tile;
+  entry.frames = frames;
+  entry.frameCount = frameCount;
+  entry.interval = interval;
+  lastTick = UINT32_MAX;
+  return true;
+}
+
+void AnimatedTiles::update()
+{
+  uint32_t tick = gbx::getTick();
+  if (tick == lastTick)
+  {
+    return;
+  }
+  lastTick = tick;
+
+  for (Entry* entry = entries; entry < entries + size; entry++)
+  {
+    current[entry->tile - firstTile] = entry->frames[(tick / entry->interval) % entry->frameCount];
+  }
+}
+
+void Tilemap::init(const int16_t* mapData, const uint16_t* tilesetData)
+{
+  if (ownTileset == NULL)
+  {
+    ownTileset = new Sprite();
+  }
+  ownTileset->init(tilesetData);
+  init(mapData, *ownTileset);
+}
+
+void Tilemap::init(const int16_t* mapData, Sprite& tileset)
+{
+  Tilemap::width = (uint16_t) *(mapData++);
+  Tilemap::height = (uint16_t) *(mapData++);
+  data = mapData;
+  compactData = NULL;
+  this->tileset = &tileset;
+}
+
+void Tilemap::init(const uint8_t* mapData, Sprite& tileset)
+{
+  Tilemap::width = *(mapData++);
+  Tilemap::height = *(mapData++);
+  data = NULL;
+  compactData = mapData;
+  this->tileset = &tileset;
+}
+
+void Tilemap::draw(int16_t x, int16_t y)
+{
+  x += this->originX;
+  y += this->originY;
+  if (animatedTiles != NULL)
+  {
+    animatedTiles->update();
+  }
+
+  const Rect& view = gbx::getView();
+  int16_t tileWidth = getTileWidth();
+  int16_t tileHeight = getTileHeight();
+  int16_t startX = (view.x - x) / tileWidth;
+  int16_t startY = (view.y - y) / tileHeight;
+  int16_t endX = (view.x + view.w - x + tileWidth - 1) / tileWidth;
+  int16_t endY = (view.y + view.h - y + tileHeight - 1) / tileHeight;
+  if (startX < 0) startX = 0;
+  if (startY < 0) startY = 0;
+  if (endX > width) endX = width;
+  if (endY > height) endY = height;
+
+  // row by row, in the same order as the map data and the screen buffer
+  for (int16_t iy = startY; iy < endY; iy++)
+  {
+    int16_t tileY = iy * tileHeight + y;
+    if (compactData != NULL)
+    {
+      const uint8_t* row = compactData + iy * width;
+      for (int16_t ix = startX; ix < endX; ix++)
+      {
+        if (row[ix] != TILE_EMPTY)
+        {
+          tileset->frame = animatedTiles != NULL ? animatedTiles->get(row[ix]) : row[ix];
+          tileset->draw(ix * tileWidth + x, tileY);
+        }
+      }
+    }
+    else
+    {
+      const int16_t* row = data + iy * width;
+      for (int16_t ix = startX; ix < endX; ix++)
+      {
+        if (row[ix] >= 0)
+        {
+          tileset->frame = animatedTiles != NULL ? animatedTiles->get(row[ix]) : row[ix];
+          tileset->draw(ix * tileWidth + x, tileY);
+        }
+      }
+    }
+  }
+}
+
+StreamingTilemap::~StreamingTilemap()
+{
+  close();
+}
+
+bool StreamingTilemap::open(const char* path, Sprite& tileset)
+{
+  close();
+
+  file = SD.open(path, O_READ);
+  if (!file)
+  {
+    return false;
+  }
+
+  // pixel coordinates are 16 bit, so must be the map size in pixels
+  uint8_t header[MAP_HEADER_SIZE];
+  if (file.read(header, sizeof(header)) != sizeof(header) || memcmp(header, "GBXM", 4) != 0 ||
+    header[4] != MAP_VERSION || (header[5] != 1 && header[5] != 2) || header[6] == 0 ||
+    (uint32_t)(header[8] | (header[9] << 8)) * tileset.getWidth() > 0x7FFF ||
+    (uint32_t)(header[10] | (header[11] << 8)) * tileset.getHeight() > 0x7FFF)
+  {
+    file.close();
+    return false;
+  }
+
+  cellSize = header[5];
+  chunkSize = header[6];
+  width = header[8] | (header[9] << 8);
+  height = header[10] | (header[11] << 8);
+  this->tileset = &tileset;
+
+  if (!allocate())
+  {
+    file.close();
+    return false;
+  }
+
+  lastFrame = gbx::getFrameStats().frame - 1;
+  return true;
+}
+
+void StreamingTilemap::close()
+{
+  if (cells != NULL)
+  {
+    file.close();
+    free(chunkX);
+    chunkX = NULL;
+    cells = NULL;
+    slots = 0;
+  }
+}
+
+bool StreamingTilemap::allocate()
+{
+  // any chunk the screen can show must fit, wherever the view is
+  int16_t chunkWidth = chunkSize * getTileWidth();
+  int16_t chunkHeight = chunkSize * getTileHeight();
+  uint16_t columns = (gbx::width + chunkWidth - 2) / chunkWidth + 1;
+  uint16_t rows = (gbx::height + chunkHeight - 2) / chunkHeight + 1;
+  uint16_t mapColumns = (width + chunkSize - 1) / chunkSize;
+  uint16_t mapRows = (height + chunkSize - 1) / chunkSize;
+  if (columns > mapColumns) columns = mapColumns;
+  if (rows > mapRows) rows = mapRows;
+
+  uint16_t count = columns * rows + STREAMING_TILEMAP_SPARE_CHUNKS;
+  if (count > 127)
+  {
+    return false;
+  }
+
+  uint32_t chunkBytes = (uint32_t)chunkSize * chunkSize * cellSize;
+  int16_t* block = (int16_t*)malloc(count * (3 * sizeof(int16_t) + chunkBytes));
+  if (block == NULL)
+  {
+    return false;
+  }
+
+  free(chunkX);
+  chunkX = block;
+  chunkY = block + count;
+  lastUsed = (uint16_t*)(block + 2 * count);
+  cells = (uint8_t*)(block + 3 * count);
+  slots = count;
+  cacheWidth = gbx::width;
+  cacheHeight = gbx::height;
+  for (uint8_t i = 0; i < slots; i++)
+  {
+    chunkX[i] = -1;
+    chunkY[i] = -1;
+    lastUsed[i] = 0;
+  }
+  return true;
+}
+
+int8_t StreamingTilemap::findChunk(int16_t x, int16_t y) const
+{
+  for (uint8_t i = 0; i < slots; i++)
+  {
+    if (chunkX[i] == x && chunkY[i] == y)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int8_t StreamingTilemap::loadChunk(int16_t x, int16_t y)
+{
+  // reuse the least recently drawn slot, never one drawn this frame
+  int8_t slot = -1;
+  uint16_t oldest = 0;
+  for (uint8_t i = 0; i < slots; i++)
+  {
+    if (chunkX[i] < 0)
+    {
+      slot = i;
+      break;
+    }
+
+    uint16_t age = drawCount - lastUsed[i];
+    if (age > oldest)
+    {
+      slot = i;
+      oldest = age;
+    }
+  }
+
+  if (slot < 0)
+  {
+    return -1;
+  }
+
+  uint32_t chunkBytes = (uint32_t)chunkSize * chunkSize * cellSize;
+  uint16_t chunksPerRow = (width + chunkSize - 1) / chunkSize;
+  file.seekSet(MAP_HEADER_SIZE + ((uint32_t)y * chunksPerRow + x) * chunkBytes);
+  if (file.read(cells + slot * chunkBytes, chunkBytes) != (int)chunkBytes)
+  {
+    chunkX[slot] = -1;
+    chunkY[slot] = -1;
+    return -1;
+  }
+
+  chunkX[slot] = x;
+  chunkY[slot] = y;
+  lastUsed[slot] = drawCount;
+  return slot;
+}
+
+int16_t StreamingTilemap::getTile(int16_t x, int16_t y) const
+{
+  if (cells == NULL || x < 0 || y < 0 || x >= width || y >= height)
+  {
+    return -1;
+  }
+
+  int8_t slot = findChunk(x / chunkSize, y / chunkSize);
+  if (slot < 0)
+  {
+    return -1;
+  }
+
+  uint32_t index = (uint32_t)slot * chunkSize * chunkSize + (y % chunkSize) * chunkSize + x % chunkSize;
+  if (cellSize == 1)
+  {
+    return cells[index] == TILE_EMPTY ? -1 : cells[index];
+  }
+  return ((const int16_t*)cells)[index];
+}
+
+void StreamingTilemap::drawChunk(uint8_t slot, int16_t startX, int16_t startY, int16_t endX, int16_t endY, int16_t x, int16_t y)
+{
+  int16_t left = chunkX[slot] * chunkSize;
+  int16_t top = chunkY[slot] * chunkSize;
+  if (startX < left) startX = left;
+  if (startY < top) startY = top;
+  if (endX > left + chunkSize) endX = left + chunkSize;
+  if (endY > top + chunkSize) endY = top + chunkSize;
+
+  int16_t tileWidth = getTileWidth();
+  int16_t tileHeight = getTileHeight();
+  for (int16_t iy = startY; iy < endY; iy++)
+  {
+    int32_t index = (int32_t)slot * chunkSize * chunkSize + (iy - top) * chunkSize - left;
+    int16_t tileY = iy * tileHeight + y;
+    if (cellSize == 1)
+    {
+      const uint8_t* row = cells + index;
+      for (int16_t ix = startX; ix < endX; ix++)
+      {
+        if (row[ix] != TILE_EMPTY)
+        {
+          tileset->frame = animatedTiles != NULL ? animatedTiles->get(row[ix]) : row[ix];
+          tileset->draw(ix * tileWidth + x, tileY);
+        }
+      }
+    }
+    else
+    {
+      const int16_t* row = (const int16_t*)cells + index;
+      for (int16_t ix = startX; ix < endX; ix++)
+      {
+        if (row[ix] >= 0)
+        {
+          tileset->frame = animatedTiles != NULL ? animatedTiles->get(row[ix]) : row[ix];
+          tileset->draw(ix * tileWidth + x, tileY);
+        }
+      }
+    }
+  }
+}
+
+void StreamingTilemap::draw(int16_t x, int16_t y)
+{
+  if (cells == NULL)
+  {
+    return;
+  }
+
+  x += this->originX;
+  y += this->originY;
+  if (animatedTiles != NULL)
+  {
+    animatedTiles->update();
+  }
+
+  // with strip rendering draw runs once per strip, the SD is only read once
+  uint32_t frame = gbx::getFrameStats().frame;
+  if (frame != lastFrame)
+  {
+    lastFrame = frame;
+    stream(x, y);
+  }
+
+  const Rect& view = gbx::getView();
+  int16_t startX = (view.x - x) / getTileWidth();
+  int16_t startY = (view.y - y) / getTileHeight();
+  int16_t endX = (view.x + view.w - x + getTileWidth() - 1) / getTileWidth();
+  int16_t endY = (view.y + view.h - y + getTileHeight() - 1) / getTileHeight();
+  if (startX < 0) startX = 0;
+  if (startY < 0) startY = 0;
+  if (endX > width) endX = width;
+  if (endY > height) endY = height;
+  if (startX >= endX || startY >= endY)
+  {
+    return;
+  }
+
+  for (int16_t cy = startY / chunkSize; cy <= (endY - 1) / chunkSize; cy++)
+  {
+    for (int16_t cx = startX / chunkSize; cx <= (endX - 1) / chunkSize; cx++)
+    {
+      int8_t slot = findChunk(cx, cy);
+      if (slot >= 0)
+      {
+        drawChunk(slot, startX, startY, endX, endY, x, y);
+      }
+    }
+  }
+}
+
+void StreamingTilemap::stream(int16_t x, int16_t y)
+{
+  if ((gbx::width > cacheWidth || gbx::height > cacheHeight) && !allocate())
+  {
+    // keep the smaller cache, the chunks that do not fit are not drawn
+    cacheWidth = gbx::width;
+    cacheHeight = gbx::height;
+  }
+  drawCount++;
+
+  int16_t tileWidth = getTileWidth();
+  int16_t tileHeight = getTileHeight();
+  int16_t chunkWidth = chunkSize * tileWidth;
+  int16_t chunkHeight = chunkSize * tileHeight;
+
+  // the chunks the screen shows must be there, load them right away if the
+  // prefetch missed them
+  int16_t left = -x;
+  int16_t top = -y;
+  int16_t right = left + gbx::width - 1;
+  int16_t bottom = top + gbx::height - 1;
+  if (left < 0) left = 0;
+  if (top < 0) top = 0;
+  if (right >= width * tileWidth) right = width * tileWidth - 1;
+  if (bottom >= height * tileHeight) bottom = height * tileHeight - 1;
+  if (left <= right && top <= bottom)
+  {
+    for (int16_t cy = top / chunkHeight; cy <= bottom / chunkHeight; cy++)
+    {
+      for (int16_t cx = left / chunkWidth; cx <= right / chunkWidth; cx++)
+      {
+        int8_t slot = findChunk(cx, cy);
+        if (slot < 0)
+        {
+          slot = loadChunk(cx, cy);
+        }
+
+        if (slot >= 0)
+        {
+          lastUsed[slot] = drawCount;
+        }
+      }
+    }
+  }
+
+  // prefetch the chunks the view is scrolling towards
+  int16_t aheadX = x < lastX ? STREAMING_TILEMAP_LOOKAHEAD : (x > lastX ? -STREAMING_TILEMAP_LOOKAHEAD : 0);
+  int16_t aheadY = y < lastY ? STREAMING_TILEMAP_LOOKAHEAD : (y > lastY ? -STREAMING_TILEMAP_LOOKAHEAD : 0);
+  lastX = x;
+  lastY = y;
+  if (aheadX == 0 && aheadY == 0)
+  {
+    return;
+  }
+
+  left = -x + aheadX;
+  top = -y + aheadY;
+  right = left + gbx::width - 1;
+  bottom = top + gbx::height - 1;
+  if (left < 0) left = 0;
+  if (top < 0) top = 0;
+  if (right >= width * tileWidth) right = width * tileWidth - 1;
+  if (bottom >= height * tileHeight) bottom = height * tileHeight - 1;
+
+  uint8_t loads = 0;
+  for (int16_t cy = top / chunkHeight; cy <= bottom / chunkHeight; cy++)
+  {
+    for (int16_t cx = left / chunkWidth; cx <= right / chunkWidth; cx++)
+    {
+      if (findChunk(cx, cy) < 0)
+      {
+        if (loads++ == STREAMING_TILEMAP_LOADS_PER_FRAME)
+        {
+          return;
+        }
+        loadChunk(cx, cy);
+      }
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Particles
+//-----------------------------------------------------------------------------
+
+namespace // unamed
+{
+  // unit vectors (8.8) for 16 directions
+  const int16_t burstDirections[16][2] = {
+    { 256, 0 }, { 237, 98 }, { 181, 181 }, { 98, 237 },
+    { 0, 256 }, { -98, 237 }, { -181, 181 }, { -237, 98 },
+    { -256, 0 }, { -237, -98 }, { -181, -181 }, { -98, -237 },
+    { 0, -256 }, { 98, -237 }, { 181, -181 }, { 237, -98 }
+  };
+
+  const Color defaultParticlePalette[] = { Color::white };
+}
+
+ParticleEmitter::ParticleEmitter(uint16_t capacity, int16_t originX, int16_t originY) :
+  Renderable(originX, originY),
+  lastTick(gbx::getTick())
+{
+  setPalette(defaultParticlePalette, 1);
+  init(capacity);
+}
+
+ParticleEmitter::~ParticleEmitter()
+{
+  free(posX);
+  free(posY);
+  free(velX);
+  free(velY);
+  free(life);
+}
+
+bool ParticleEmitter::init(uint16_t capacity)
+{
+  count = 0;
+  free(posX);
+  free(posY);
+  free(velX);
+  free(velY);
+  free(life);
+
+  posX = (int32_t*)malloc(capacity * sizeof(int32_t));
+  posY = (int32_t*)malloc(capacity * sizeof(int32_t));
+  velX = (int16_t*)malloc(capacity * sizeof(int16_t));
+  velY = (int16_t*)malloc(capacity * sizeof(int16_t));
+  life = (uint8_t*)malloc(capacity);
+  if (posX == NULL || posY == NULL || velX == NULL || velY == NULL || life == NULL)
+  {
+    free(posX);
+    free(posY);
+    free(velX);
+    free(velY);
+    free(life);
+    posX = NULL;
+    posY = NULL;
+    velX = NULL;
+    velY = NULL;
+    life = NULL;
+    this->capacity = 0;
+    return false;
+  }
+
+  this->capacity = capacity;
+  return true;
+}
+
+bool ParticleEmitter::emit(int16_t x, int16_t y, int16_t vx, int16_t vy, uint8_t life)
+{
+  if (count == capacity || life == 0)
+  {
+    return false;
+  }
+
+  posX[count] = (int32_t)x << 8;
+  posY[count] = (int32_t)y << 8;
+  velX[count] = vx;
+  velY[count] = vy;
+  this->life[count] = life;
+  count++;
+  return true;
+}
+
+void ParticleEmitter::burst(int16_t x, int16_t y, uint8_t count, int16_t speed, uint8_t life)
+{
+  for (uint8_t i = 0; i < count; i++)
+  {
+    const int16_t* direction = burstDirections[random(16)];
+    int16_t s = random(speed / 2, speed + 1);
+    if (!emit(x, y, ((int32_t)direction[0] * s) >> 8, ((int32_t)direction[1] * s) >> 8, life - random(life / 4 + 1)))
+    {
+      return;
+    }
+  }
+}
+
+void ParticleEmitter::clear()
+{
+  count = 0;
+}
+
+bool ParticleEmitter::setPalette(const Color* colors, uint8_t count, uint8_t paletteShift)
+{
+  if (count == 0)
+  {
+    return false;
+  }
+
+  palette = colors;
+  paletteCount = count;
+  this->paletteShift = paletteShift;
+  return true;
+}
+
+void ParticleEmitter::step()
+{
+  uint16_t i = 0;
+  while (i < count)
+  {
+    if (--life[i] == 0)
+    {
+      // keep the arrays packed: the last particle takes the dead one's place
+      count--;
+      posX[i] = posX[count];
+      posY[i] = posY[count];
+      velX[i] = velX[count];
+      velY[i] = velY[count];
+      life[i] = life[count];
+      continue;
+    }
+
+    velX[i] += gravityX;
+    velY[i] += gravityY;
+    posX[i] += velX[i];
+    posY[i] += velY[i];
+    i++;
+  }
 }
 
-void gbx::update()
+void ParticleEmitter::draw(int16_t x, int16_t y)
 {
-  while (!gb.update());
-
-  if (wasPressed(BUTTON_MENU))
+  uint32_t tick = gbx::getTick();
+  uint32_t steps = tick - lastTick;
+  lastTick = tick;
+  if (steps > PARTICLE_MAX_STEPS)
   {
-    debugLevel = (debugLevel + 1) % 3;
+    steps = PARTICLE_MAX_STEPS;
   }
-
-  if (scene != NULL)
+  while (steps-- > 0 && count > 0)
   {
-    scene->update();
-    scene->draw();
+    step();
   }
 
-  if (debugLevel > 0)
+  x += this->originX;
+  y += this->originY;
+
+  Canvas& canvas = gbx::getCanvas();
+  const Rect& clip = canvas.getClip();
+  int16_t right = clip.x + clip.w;
+  int16_t bottom = clip.y + clip.h;
+  uint8_t lastColor = paletteCount - 1;
+  uint32_t pixels = 0;
+  for (uint16_t i = 0; i < count; i++)
   {
-    if (debugLevel > 1 && scene != NULL)
+    int16_t px = (int16_t)(posX[i] >> 8) + x;
+    int16_t py = (int16_t)(posY[i] >> 8) + y;
+    if (px >= clip.x && px < right && py >= clip.y && py < bottom)
     {
-      scene->drawDebug();
+      uint8_t index = life[i] >> paletteShift;
+      *canvas.getAddress(px, py) = (uint16_t)palette[index < lastColor ? index : lastColor];
+      pixels++;
     }
-
-    drawString(0, 0, format("cpu=%d", gb.getCpuLoad()));
-    drawString(0, 6, format("ram=%d", gb.getFreeRam()));
-    drawString(0, 12, format("cnt=%d", entityCount));
   }
+  frameStats.pixelCount += pixels;
 }
 
-void gbx::setScene(Scene& scene)
+//-----------------------------------------------------------------------------
+// Audio
+//-----------------------------------------------------------------------------
+
+#if AUDIO
+namespace // unamed
 {
-  entityCount = 0;
+  struct Voice
+  {
+    const Sfx* sfx;
+    uint32_t startFrame;
+    uint8_t note;
+    uint16_t framesLeft;
+    int8_t track = -1;
+  };
 
-  ::scene = &scene;
-  scene.init();
-}
+  Voice voices[AUDIO_VOICES];
 
-Scene& gbx::getScene()
-{
-  return *::scene;
-}
+  const Music* music = NULL;
+  bool musicLoop;
+  uint8_t musicOrder;
+  uint8_t musicRow;
+  uint8_t musicFramesLeft;
+  int8_t musicTrack = -1;
 
-void gbx::clear(Color color)
-{
-  gb.display.clear(color);
-}
+  // frequencies of the octave starting at MIDI note 120
+  const uint16_t topOctave[12] = { 8372, 8870, 9397, 9956, 10548, 11175, 11840, 12544, 13290, 14080, 14917, 15804 };
 
-void gbx::setPixel(int16_t x, int16_t y, Color c)
-{
-  gb.display.drawPixel(x, y, c);
-}
+  uint32_t noteFrequency(uint8_t note)
+  {
+    return note >= 120 ? topOctave[note % 12] : topOctave[note % 12] >> (10 - note / 12);
+  }
 
-Color gbx::getPixel(int16_t x, int16_t y)
-{
-  return gb.display.getPixelColor(x, y);
-}
+  void stopTrack(int8_t& track)
+  {
+    if (track >= 0)
+    {
+      gb.sound.stop(track);
+      track = -1;
+    }
+  }
 
-void gbx::drawLine(int16_t x0, int16_t y0, int16_t x1, int16_t y1, Color c)
-{
-  gb.display.setColor(c);
-  gb.display.drawLine(x0, y0, x1, y1);
-}
+  void startNote(Voice& voice)
+  {
+    stopTrack(voice.track);
+    const uint16_t* note = voice.sfx->notes + voice.note * 2;
+    if (note[0] != 0)
+    {
+      voice.track = gb.sound.tone(note[0]);
+    }
+    voice.framesLeft = note[1] > 0 ? note[1] : 1;
+  }
 
-void gbx::drawFastVLine(int16_t x, int16_t y, int16_t h, Color c)
-{
-  gb.display.setColor(c);
-  gb.display.drawFastVLine(x, y, h);
-}
+  void stopVoice(Voice& voice)
+  {
+    stopTrack(voice.track);
+    voice.sfx = NULL;
+  }
 
-void gbx::drawFastHLine(int16_t x, int16_t y, int16_t w, Color c)
-{
-  gb.display.setColor(c);
-  gb.display.drawFastHLine(x, y, w);
-}
+  void playRow()
+  {
+    uint8_t note = music->patterns[music->order[musicOrder]][musicRow];
+    if (note == NOTE_OFF)
+    {
+      stopTrack(musicTrack);
+    }
+    else if (note != NOTE_HOLD)
+    {
+      stopTrack(musicTrack);
+      musicTrack = gb.sound.tone(noteFrequency(note));
+    }
+    musicFramesLeft = music->rowFrames;
+  }
 
-void gbx::drawRect(int16_t x, int16_t y, int16_t w, int16_t h, Color c)
-{
-  gb.display.setColor(c);
-  gb.display.drawRect(x, y, w, h);
-}
+  void updateAudio()
+  {
+    for (Voice* voice = voices; voice < voices + AUDIO_VOICES; voice++)
+    {
+      if (voice->sfx != NULL && --voice->framesLeft == 0)
+      {
+        if (++voice->note < voice->sfx->noteCount)
+        {
+          startNote(*voice);
+        }
+        else
+        {
+          stopVoice(*voice);
+        }
+      }
+    }
 
-void gbx::fillRect(int16_t x, int16_t y, int16_t w, int16_t h, Color c)
-{
-  gb.display.setColor(c);
-  gb.display.fillRect(x, y, w, h);
+    if (music != NULL && --musicFramesLeft == 0)
+    {
+      if (++musicRow == music->patternLength)
+      {
+        musicRow = 0;
+        if (++musicOrder == music->orderLength)
+        {
+          if (!musicLoop)
+          {
+            gbx::stopMusic();
+            return;
+          }
+          musicOrder = 0;
+        }
+      }
+      playRow();
+    }
+  }
 }
 
-void gbx::drawCircle(int16_t x, int16_t y, int16_t r, Color c)
+bool gbx::playSfx(const Sfx& sfx)
 {
-  gb.display.setColor(c);
-  gb.display.drawCircle(x, y, r);
-}
+  Voice* target = NULL;
+  for (Voice* voice = voices; voice < voices + AUDIO_VOICES; voice++)
+  {
+    if (voice->sfx == &sfx && voice->startFrame == frameStats.frame)
+    {
+      // already started this frame, for example by many bullets hitting at once
+      return true;
+    }
 
-void gbx::fillCircle(int16_t x, int16_t y, int16_t r, Color c)
-{
-  gb.display.setColor(c);
-  gb.display.fillCircle(x, y, r);
-}
+    if (target == NULL || (target->sfx != NULL && (voice->sfx == NULL || voice->sfx->priority < target->sfx->priority ||
+      (voice->sfx->priority == target->sfx->priority && voice->startFrame < target->startFrame))))
+    {
+      target = voice;
+    }
+  }
 
-void gbx::drawChar(int16_t x, int16_t y, char chr, Color c, Gamebuino_Meta::GFXfont* font)
-{
-  gb.display.setFont(font);
-  gb.display.setColor(c);
-  gb.display.setCursor(x, y);
-  gb.display.write(chr);
+  if (sfx.noteCount == 0 || (target->sfx != NULL && target->sfx->priority > sfx.priority))
+  {
+    return false;
+  }
+
+  target->sfx = &sfx;
+  target->startFrame = frameStats.frame;
+  target->note = 0;
+  startNote(*target);
+  return true;
 }
 
-void gbx::drawString(int16_t x, int16_t y, const char* str, Color c, Gamebuino_Meta::GFXfont* font)
+void gbx::stopSfx(const Sfx& sfx)
 {
-  gb.display.setFont(font);
-  gb.display.setColor(c);
-  gb.display.setCursor(x, y);
-  for (size_t i = 0; i < strlen(str); i++)
+  for (Voice* voice = voices; voice < voices + AUDIO_VOICES; voice++)
   {
-    gb.display.write(str[i]);
+    if (voice->sfx == &sfx)
+    {
+      stopVoice(*voice);
+    }
   }
 }
 
-namespace
+void gbx::stopAllSfx()
 {
-  char formatBuffer[128];
+  for (Voice* voice = voices; voice < voices + AUDIO_VOICES; voice++)
+  {
+    if (voice->sfx != NULL)
+    {
+      stopVoice(*voice);
+    }
+  }
 }
 
-const char* gbx::format(const char* format...)
+void gbx::playMusic(const Music& music, bool loop)
 {
-  va_list ap;
-  va_start(ap, format);
-  vsnprintf(formatBuffer, sizeof(formatBuffer), format, ap);
-  va_end(ap);
-  return formatBuffer;
-}
+  stopMusic();
+  if (music.orderLength == 0 || music.patternLength == 0 || music.rowFrames == 0)
+  {
+    return;
+  }
 
-bool gbx::isDown(Gamebuino_Meta::Button button)
-{
-  return gb.buttons.repeat(button, 0);
+  ::music = &music;
+  musicLoop = loop;
+  musicOrder = 0;
+  musicRow = 0;
+  playRow();
 }
 
-bool gbx::wasPressed(Gamebuino_Meta::Button button)
+void gbx::stopMusic()
 {
-  return gb.buttons.pressed(button);
+  stopTrack(musicTrack);
+  music = NULL;
 }
 
-bool gbx::wasReleased(Gamebuino_Meta::Button button)
+bool gbx::isMusicPlaying()
 {
-  return gb.buttons.released(button);
+  return music != NULL;
 }
+#endif
 
 //-----------------------------------------------------------------------------
-// Entity
+// Post effects
 //-----------------------------------------------------------------------------
 
-void Entity::_init(int16_t x, int16_t y)
+#if POST_EFFECTS
+namespace // unamed
 {
-  this->x = x;
-  this->y = y;
-  flags = _FLAG_ACTIVE | FLAG_COLLIDABLE | FLAG_VISIBLE;
-  entityCount++;
-  onInit();
-}
+  uint16_t tintColor = 0xFFFF;
+  uint16_t fadeColor;
+  uint16_t fadeAmount = 0;
+  uint16_t flashColor;
+  uint8_t flashDuration = 0;
+  uint32_t flashStart;
+  uint8_t shakeAmplitude = 0;
+  uint8_t shakeDuration = 0;
+  uint32_t shakeStart;
 
-void Entity::remove()
-{
-  _pool->remove(this);
-  entityCount--;
-}
+  // the channels of a pixel are looked up separately and or-ed together
+  uint16_t redTable[32];
+  uint16_t greenTable[64];
+  uint16_t blueTable[32];
+  bool tableDirty = true;
+  bool tableIdentity = true;
+  uint16_t lastFlashAmount = 0;
 
-uint8_t Entity::getType()
-{
-  return _pool->getType();
-}
+  uint8_t mixChannel(uint8_t value, uint8_t tint, uint8_t fade, uint16_t fadeAmount, uint8_t flash, uint16_t flashAmount, uint8_t max)
+  {
+    uint16_t v = value * (tint + 1) / (max + 1);
+    v += ((int16_t)fade - (int16_t)v) * (int16_t)fadeAmount / 256;
+    v += ((int16_t)flash - (int16_t)v) * (int16_t)flashAmount / 256;
+    return v;
+  }
 
-void Entity::drawDebug(int16_t x, int16_t y)
-{
-  gbx::drawRect(x + hitboxX, y + hitboxY, hitboxWidth, hitboxHeight, Color::lightblue);
-  gbx::setPixel(x, y, Color::red);
-}
+  void buildTable(uint16_t flashAmount)
+  {
+    tableIdentity = tintColor == 0xFFFF && fadeAmount == 0 && flashAmount == 0;
+    for (uint8_t i = 0; i < 32; i++)
+    {
+      redTable[i] = mixChannel(i, tintColor >> 11, fadeColor >> 11, fadeAmount, flashColor >> 11, flashAmount, 31) << 11;
+      blueTable[i] = mixChannel(i, tintColor & 31, fadeColor & 31, fadeAmount, flashColor & 31, flashAmount, 31);
+    }
+    for (uint8_t i = 0; i < 64; i++)
+    {
+      greenTable[i] = mixChannel(i, (tintColor >> 5) & 63, (fadeColor >> 5) & 63, fadeAmount, (flashColor >> 5) & 63, flashAmount, 63) << 5;
+    }
+    lastFlashAmount = flashAmount;
+    tableDirty = false;
+  }
 
-bool Entity::collide(int16_t x, int16_t y, uint16_t w, uint16_t h) const
-{
-  return gb.collideRectRect(Entity::x + hitboxX, Entity::y + hitboxY, hitboxWidth, hitboxHeight, x, y, w, h);
-}
+  // amount left of an effect, from 256 at the start down to 0 after duration ticks
+  uint16_t remaining(uint32_t start, uint8_t duration)
+  {
+    uint32_t elapsed = tick - start;
+    return elapsed >= duration ? 0 : (duration - elapsed) * 256 / duration;
+  }
 
-Entity* Entity::query(int16_t x, int16_t y, const uint8_t collideTypeIds[]) const
-{
-  return gbx::getScene().query(x + hitboxX, y + hitboxY, hitboxWidth, hitboxHeight, collideTypeIds);
-}
+  // private xorshift, the shake must not consume the game's random() sequence
+  uint32_t shakeSeed = 2463534242;
 
-void Entity::moveBy(int16_t dx, int16_t dy, const uint8_t collideTypeIds[])
-{
-  if (collideTypeIds == NULL)
+  int16_t shakeOffset(uint16_t amplitude)
   {
-    x += dx;
-    y += dy;
-    return;
+    shakeSeed ^= shakeSeed << 13;
+    shakeSeed ^= shakeSeed >> 17;
+    shakeSeed ^= shakeSeed << 5;
+    return (int16_t)(((shakeSeed >> 16) * (2 * amplitude + 1)) >> 16) - amplitude;
   }
 
-  if (dx != 0)
+  inline uint16_t lookup(uint16_t pixel)
   {
-    int16_t sign = dx < 0 ? -1 : 1;
-    int16_t dist = dx * sign;
-    while (dist > 0)
+    return redTable[pixel >> 11] | greenTable[(pixel >> 5) & 63] | blueTable[pixel & 31];
+  }
+
+  void prepareEffects(int16_t& shakeX, int16_t& shakeY)
+  {
+    uint16_t flashAmount = flashDuration > 0 ? remaining(flashStart, flashDuration) : 0;
+    if (flashAmount == 0)
     {
-      Entity* other = query(x + sign, y, collideTypeIds);
-      if (other != NULL && onMoveCollideX(*other))
+      flashDuration = 0;
+    }
+    if (tableDirty || flashAmount != lastFlashAmount)
+    {
+      buildTable(flashAmount);
+    }
+
+    if (shakeDuration > 0)
+    {
+      uint16_t amplitude = shakeAmplitude * remaining(shakeStart, shakeDuration) >> 8;
+      if (amplitude == 0)
       {
-        break;
+        shakeDuration = 0;
+      }
+      else
+      {
+        shakeX = shakeOffset(amplitude);
+        shakeY = shakeOffset(amplitude);
       }
-      dist--;
-      x += sign;
     }
   }
 
-  if (dy != 0)
+  void applyColors(uint16_t* pixels, int16_t count)
   {
-    int16_t sign = dy < 0 ? -1 : 1;
-    int16_t dist = dy * sign;
-    while (dist > 0)
+    if (tableIdentity)
     {
-      Entity* other = query(x, y + sign, collideTypeIds);
-      if (other != NULL && onMoveCollideY(*other))
+      return;
+    }
+    for (int16_t i = 0; i < count; i++)
+    {
+      pixels[i] = lookup(pixels[i]);
+    }
+  }
+
+  void applyEffects(int16_t dx, int16_t dy)
+  {
+    if (tableIdentity && dx == 0 && dy == 0)
+    {
+      return;
+    }
+
+    // shift in place, walking away from the direction of the move so that
+    // every source pixel is read before it is overwritten
+    int16_t width = screen.width;
+    int16_t height = screen.height;
+    uint16_t* buffer = screen.buffer;
+    int16_t startY = dy > 0 ? height - 1 : 0;
+    int16_t stepY = dy > 0 ? -1 : 1;
+    int16_t startX = dx > 0 ? width - 1 : 0;
+    int16_t stepX = dx > 0 ? -1 : 1;
+    for (int16_t y = startY; y >= 0 && y < height; y += stepY)
+    {
+      int16_t sourceY = y - dy;
+      uint16_t* row = buffer + y * width;
+      if (sourceY < 0 || sourceY >= height)
       {
-        break;
+        memset(row, 0, width * sizeof(uint16_t));
+        continue;
+      }
+
+      const uint16_t* source = buffer + sourceY * width;
+      if (dx == 0)
+      {
+        for (int16_t x = 0; x < width; x++)
+        {
+          row[x] = lookup(source[x]);
+        }
+        continue;
+      }
+
+      for (int16_t x = startX; x >= 0 && x < width; x += stepX)
+      {
+        int16_t sourceX = x - dx;
+        row[x] = sourceX >= 0 && sourceX < width ? lookup(source[sourceX]) : 0;
       }
-      dist--;
-      y += sign;
     }
   }
 }
 
-void Entity::moveTo(int16_t x, int16_t y, const uint8_t collideTypeIds[])
+void gbx::setTint(Color color)
 {
-  moveBy(x - Entity::x, y - Entity::y, collideTypeIds);
+  tintColor = (uint16_t)color;
+  tableDirty = true;
+}
+
+void gbx::setFade(Color color, uint16_t amount)
+{
+  fadeColor = (uint16_t)color;
+  fadeAmount = amount > 256 ? 256 : amount;
+  tableDirty = true;
+}
+
+void gbx::flash(Color color, uint8_t duration)
+{
+  flashColor = (uint16_t)color;
+  flashDuration = duration;
+  flashStart = tick;
+  tableDirty = true;
+}
+
+void gbx::shake(uint8_t amplitude, uint8_t duration)
+{
+  shakeAmplitude = amplitude;
+  shakeDuration = duration;
+  shakeStart = tick;
+}
+
+void gbx::clearEffects()
+{
+  tintColor = 0xFFFF;
+  fadeAmount = 0;
+  flashDuration = 0;
+  shakeDuration = 0;
+  tableDirty = true;
 }
+#endif
 
 //-----------------------------------------------------------------------------
-// Scene
+// Strip rendering
 //-----------------------------------------------------------------------------
 
-Scene::Scene() :
-  pools(TYPES_INITIAL_CAPACITY)
+#if STRIP_RENDERER
+namespace Gamebuino_Meta
+{
+  extern volatile uint32_t dma_desc_free_count; // Display-ST7735.cpp
+}
+
+void TftSink::wait()
+{
+  if (pending)
+  {
+    while (Gamebuino_Meta::dma_desc_free_count < 3);
+    gb.tft.idleMode();
+    SPI.endTransaction();
+    pending = false;
+  }
+}
+
+void TftSink::writeStrip(uint16_t* pixels, int16_t y, int16_t width, int16_t height)
+{
+  wait();
+
+  // the screen expects big endian pixels
+  uint16_t count = width * height;
+  for (uint16_t i = 0; i < count; i++)
+  {
+    pixels[i] = (pixels[i] << 8) | (pixels[i] >> 8);
+  }
+
+  gb.tft.setAddrWindow(0, y, width - 1, y + height - 1);
+  SPI.beginTransaction(Gamebuino_Meta::tftSPISettings);
+  gb.tft.dataMode();
+  gb.tft.sendBuffer(pixels, count);
+  pending = true;
+}
+
+void TftSink::endFrame()
 {
+  wait();
 }
 
-Scene::~Scene()
+void MemorySink::writeStrip(uint16_t* pixels, int16_t y, int16_t width, int16_t height)
 {
+  for (int16_t row = 0; row < height; row++)
+  {
+    memcpy(buffer + (y + row) * this->width, pixels + row * width, width * sizeof(uint16_t));
+  }
 }
 
-void Scene::init()
+bool gbx::setStripRendering(DisplaySink* sink, int16_t width, int16_t height, uint8_t stripHeight)
 {
-  for (auto renderables = layers.begin(); renderables != layers.end(); renderables++)
+  free(strips[0]);
+  free(strips[1]);
+  strips[0] = NULL;
+  strips[1] = NULL;
+
+  // the snapshots do not match the new screen
+  for (uint8_t i = 0; i < sceneDepth; i++)
   {
-    (*renderables)->clear();
+    free(sceneSnapshots[i]);
+    sceneSnapshots[i] = NULL;
   }
 
-  for (IEntityPool** pool = pools.begin(); pool < pools.end(); pool++)
+  if (sink != NULL)
   {
-    if (*pool != NULL)
+    // release the display buffer first, 160x128 would not fit
+    gb.display.init(0, 0, ColorMode::rgb565);
+    size_t size = width * stripHeight * sizeof(uint16_t);
+    strips[0] = (uint16_t*)malloc(size);
+    strips[1] = (uint16_t*)malloc(size);
+    if (strips[0] != NULL && strips[1] != NULL)
     {
-      add(**pool, (*pool)->getLayer());
+      stripSink = sink;
+      ::stripHeight = stripHeight;
+      gbx::width = width;
+      gbx::height = height;
+      screen = Canvas(strips[0], width, height);
+      screen.setBuffer(strips[0], { 0, 0, 0, 0 });
+      return true;
     }
+
+    free(strips[0]);
+    free(strips[1]);
+    strips[0] = NULL;
+    strips[1] = NULL;
   }
 
-  onInit();
+  stripSink = NULL;
+  gb.display.init(80, 64, ColorMode::rgb565);
+  gbx::width = gb.display.width();
+  gbx::height = gb.display.height();
+  screen = Canvas(gb.display._buffer, gbx::width, gbx::height);
+  return sink == NULL;
 }
+#endif
 
-void Scene::_addPool(IEntityPool * pool)
+//-----------------------------------------------------------------------------
+// Save states
+//-----------------------------------------------------------------------------
+
+#if SAVE_STATES
+void StateBuffer::write(const void* data, uint16_t length)
 {
-  pools[pool->getType()] = pool;
+  if (StateWriter::failed || length > capacity - size)
+  {
+    StateWriter::failed = true;
+    return;
+  }
+  memcpy(this->data + size, data, length);
+  size += length;
 }
 
-void Scene::add(IRenderable& renderable, uint8_t layer)
+void StateBuffer::read(void* data, uint16_t length)
 {
-  PtrVector<IRenderable>* renderables = layers[layer];
-  if (renderables == NULL)
+  if (StateReader::failed || length > size - position)
   {
-    renderables = new PtrVector<IRenderable>(RENDERABLES_BY_LAYER_INITIAL_CAPACITY);
-    layers[layer] = renderables;
+    StateReader::failed = true;
+    memset(data, 0, length);
+    return;
   }
-  renderables->add(&renderable);
+  memcpy(data, this->data + position, length);
+  position += length;
 }
 
-void Scene::update()
+void StateBuffer::clear()
 {
-  for (IEntityPool** pool = pools.begin(); pool < pools.end(); pool++)
+  size = 0;
+  position = 0;
+  StateWriter::failed = false;
+  StateReader::failed = false;
+}
+
+void StateBuffer::rewind()
+{
+  position = 0;
+  StateReader::failed = false;
+}
+
+namespace // unamed
+{
+  class FileStateWriter : public StateWriter
   {
-    if (*pool != NULL)
+  public:
+    void write(const void* data, uint16_t length)
     {
-      (*pool)->update();
+      file.write(data, length);
     }
-  }
-}
 
-void Scene::draw()
-{
-  gbx::clear();
+    FileWriter file;
+  };
 
-  for (PtrVector<IRenderable>** renderables = layers.begin(); renderables < layers.end(); renderables++)
+  class FileStateReader : public StateReader
   {
-    if (*renderables != NULL)
+  public:
+    void read(void* data, uint16_t length)
     {
-      for (IRenderable** renderable = (*renderables)->begin(); renderable < (*renderables)->end(); renderable++)
+      // the file reader needs the whole read to fit in its buffer
+      uint8_t* dest = (uint8_t*)data;
+      while (length > 0)
       {
-        (*renderable)->draw(-cameraX, -cameraY);
+        uint16_t chunk = length < SAVE_BUFFER_SIZE ? length : SAVE_BUFFER_SIZE;
+        if (failed || !file.read(dest, chunk))
+        {
+          failed = true;
+          memset(dest, 0, length);
+          return;
+        }
+        dest += chunk;
+        length -= chunk;
       }
     }
+
+    FileReader file;
+  };
+}
+
+bool gbx::saveState(const char* path)
+{
+  FileStateWriter out;
+  if (scene == NULL || !out.file.open(path, SAVE_BUFFER_SIZE))
+  {
+    return false;
   }
+
+  bool saved = scene->saveState(out);
+  return out.file.close() && saved;
 }
 
-void Scene::drawDebug()
+namespace // unamed
 {
-  for (IEntityPool** pool = pools.begin(); pool < pools.end(); pool++)
+  enum
   {
-    if (*pool != NULL)
+    SAVING_IDLE,
+    SAVING_OPEN,
+    SAVING_WRITE,
+    SAVING_CLOSE
+  };
+
+  uint8_t savingStep = SAVING_IDLE;
+  const char* savingPath;
+  const StateBuffer* savingBuffer;
+  uint16_t savingWritten;
+  uint32_t savingBudget;
+  bool savingFailed = false;
+  File savingFile;
+
+  // one step of startSaveState per frame: open, write under the budget, close
+  void updateSaving()
+  {
+    switch (savingStep)
     {
-      (*pool)->drawDebug(-cameraX, -cameraY);
+      case SAVING_OPEN:
+        savingFile = SD.open(savingPath, O_WRITE | O_CREAT | O_TRUNC);
+        if (!savingFile)
+        {
+          savingFailed = true;
+          savingStep = SAVING_IDLE;
+          return;
+        }
+        savingStep = SAVING_WRITE;
+        break;
+
+      case SAVING_WRITE:
+      {
+        uint32_t start = micros();
+        do
+        {
+          uint16_t left = savingBuffer->getSize() - savingWritten;
+          uint16_t chunk = left < SAVE_BUFFER_SIZE ? left : SAVE_BUFFER_SIZE;
+          if (savingFile.write(savingBuffer->data + savingWritten, chunk) != chunk)
+          {
+            savingFailed = true;
+            savingFile.close();
+            savingStep = SAVING_IDLE;
+            return;
+          }
+          savingWritten += chunk;
+        }
+        while (savingWritten < savingBuffer->getSize() && micros() - start < savingBudget);
+
+        if (savingWritten == savingBuffer->getSize())
+        {
+          savingStep = SAVING_CLOSE;
+        }
+        break;
+      }
+
+      case SAVING_CLOSE:
+        if (!savingFile.sync())
+        {
+          savingFailed = true;
+        }
+        savingFile.close();
+        savingStep = SAVING_IDLE;
+        break;
     }
   }
 }
 
-Entity* Scene::query(int16_t x, int16_t y, uint16_t w, uint16_t h, uint8_t entityType)
+bool gbx::startSaveState(const char* path, StateBuffer& buffer, uint16_t budget)
 {
-  if (entityType >= pools.getSize())
+  if (scene == NULL || savingStep != SAVING_IDLE)
   {
-    return NULL;
+    return false;
   }
 
-  IEntityPool* pool = pools[entityType];
-  if (pool != NULL)
+  buffer.clear();
+  if (!scene->saveState(buffer))
   {
-    Entity* entity = pool->query(x, y, w, h);
-    if (entity != NULL)
-    {
-      return entity;
-    }
+    return false;
   }
 
-  return NULL;
+  savingPath = path;
+  savingBuffer = &buffer;
+  savingWritten = 0;
+  savingBudget = budget > 0 ? budget : frameDuration / 4;
+  savingFailed = false;
+  savingStep = SAVING_OPEN;
+  return true;
 }
 
-Entity* Scene::query(int16_t x, int16_t y, uint16_t w, uint16_t h, const uint8_t entityTypes[])
+bool gbx::isSaving()
 {
-  for (uint8_t i = 1; i <= entityTypes[0]; i++)
+  return savingStep != SAVING_IDLE;
+}
+
+bool gbx::hasSaveFailed()
+{
+  return savingFailed;
+}
+
+bool gbx::loadState(const char* path)
+{
+  FileStateReader in;
+  if (scene == NULL || !in.file.open(path, SAVE_BUFFER_SIZE))
   {
-    Entity* entity = query(x, y, w, h, entityTypes[i]);
-    if (entity != NULL)
-    {
-      return entity;
-    }
+    return false;
   }
 
-  return NULL;
+  bool loaded = scene->loadState(in);
+  in.file.close();
+  return loaded;
 }
+#endif
 
 //-----------------------------------------------------------------------------
-// Sprite
+// Pathfinding
 //-----------------------------------------------------------------------------
 
-// TODO add support for horiz/vert flip
+#if PATHFINDING
+#define FLOW_CHECK_INTERVAL 32 // cells between two looks at the clock
 
-void Sprite::init(const uint16_t *data)
+namespace // unamed
 {
-  width = pgm_read_word(data++);
-  height = pgm_read_word(data++);
-  transparentColor = pgm_read_word(data++);
-  buffer = data;
+  // orthogonal steps first so that ties prefer straight moves, the opposite
+  // of a direction is direction ^ 2
+  const int8_t flowX[8] = { 1, 0, -1, 0, 1, -1, -1, 1 };
+  const int8_t flowY[8] = { 0, 1, 0, -1, 1, 1, -1, -1 };
+
+  inline uint8_t getFlow(const uint8_t* field, uint16_t cell)
+  {
+    return (field[cell >> 1] >> ((cell & 1) << 2)) & 0xF;
+  }
+
+  inline void setFlow(uint8_t* field, uint16_t cell, uint8_t direction)
+  {
+    uint8_t shift = (cell & 1) << 2;
+    field[cell >> 1] = (field[cell >> 1] & ~(0xF << shift)) | (direction << shift);
+  }
 }
 
-void Sprite::draw(int16_t x, int16_t y)
+FlowField::~FlowField()
 {
-  x += this->originX;
-  y += this->originY;
+  free(front);
+  free(back);
+  free(queue);
+}
 
-  if ((x > gbx::width) || ((x + width) < 0) || (y > gbx::height) || ((y + height) < 0))
+bool FlowField::init(const Tilemap& map)
+{
+  free(front);
+  free(back);
+  free(queue);
+  front = NULL;
+  back = NULL;
+  queue = NULL;
+  queueSize = 0;
+  this->map = &map;
+  target = FLOW_NO_CELL;
+  pendingTarget = FLOW_NO_CELL;
+  searching = false;
+
+  uint32_t cells = (uint32_t)map.getWidth() * map.getHeight();
+  if (cells == 0 || cells >= FLOW_NO_CELL)
   {
-    // out of screen!
-    return;
+    return false;
   }
 
-  // horizontal cropping (same as in GameBuino-Meta.h)
-  int16_t xOffset = 0;
-  int16_t renderWidth = width;
-  if (x < 0)
+  size_t fieldSize = (cells + 1) / 2;
+  front = (uint8_t*)malloc(fieldSize);
+  back = (uint8_t*)malloc(fieldSize);
+  if (front == NULL || back == NULL)
   {
-    xOffset = -x;
-    renderWidth = width + x;
-    if (renderWidth > gbx::width)
-    {
-      renderWidth = gbx::width;
-    }
+    free(front);
+    free(back);
+    front = NULL;
+    back = NULL;
+    return false;
   }
-  else if ((x + width) > gbx::width)
+
+  memset(front, 0xFF, fieldSize);
+  return true;
+}
+
+void FlowField::setWalkable(int16_t tile, bool walkable)
+{
+  if (tile < 0)
   {
-    renderWidth = gbx::width - x;
+    walkableEmpty = walkable;
   }
-
-  // vertical cropping (same as in GameBuino-Meta.h)
-  int16_t yOffset = 0;
-  int16_t renderHeight = height;
-  if (y < 0)
+  else if (tile < 256)
   {
-    yOffset = -y;
-    renderHeight = height + y;
-    if (renderHeight > gbx::height)
+    if (walkable)
+    {
+      walkableTiles[tile >> 3] |= 1 << (tile & 7);
+    }
+    else
     {
-      renderHeight = gbx::height;
+      walkableTiles[tile >> 3] &= ~(1 << (tile & 7));
     }
   }
-  else if ((y + height) > gbx::height)
+}
+
+uint16_t FlowField::getCell(int16_t x, int16_t y) const
+{
+  if (front == NULL)
   {
-    renderHeight = gbx::height - y;
+    return FLOW_NO_CELL;
   }
 
-  // calculate source and dest pointers initial address
-  const uint16_t* sourcePtr = buffer + (yOffset * width);
-  
-  if (flip)
+  x -= map->originX;
+  y -= map->originY;
+  if (x < 0 || y < 0)
   {
-    sourcePtr += width - xOffset - 1;
+    return FLOW_NO_CELL;
   }
-  else
+
+  uint16_t column = x / map->getTileWidth();
+  uint16_t row = y / map->getTileHeight();
+  if (column >= map->getWidth() || row >= map->getHeight())
   {
-    sourcePtr += xOffset;
+    return FLOW_NO_CELL;
   }
+  return row * map->getWidth() + column;
+}
 
-  if (frame > 0)
+void FlowField::setTarget(int16_t x, int16_t y)
+{
+  uint16_t cell = getCell(x, y);
+  if (cell == FLOW_NO_CELL)
   {
-    sourcePtr += frame * width * height;
+    return;
   }
-  
-  uint16_t* destPtr = gb.display._buffer + (y + yOffset) * gb.display.width() + x + xOffset;
 
-  // rendering code
-  if (!flip && !transparentColor)
+  // restarting would never finish on big maps with a moving target, back on
+  // the target being searched for nothing more is needed
+  if (searching)
   {
-    // no flip, no transparent color, use memcpy
-    for (uint8_t iy = 0; iy < renderHeight; iy++)
-    {
-      memcpy(destPtr, sourcePtr, renderWidth * 2);
-      sourcePtr += width;
-      destPtr += gb.display.width();
-    }
+    pendingTarget = cell == target && !stale ? FLOW_NO_CELL : cell;
   }
-  else if(!flip)
+  else if (cell != target)
   {
-    // no flip, transparent color, copy pixel by pixel
-    for (uint8_t iy = 0; iy < renderHeight; iy++)
-    {
-      for (uint8_t ix = 0; ix < renderWidth; ix++)
-      {
-        if (*sourcePtr != transparentColor)
-        {
-          *destPtr = *sourcePtr;
-        }
-        sourcePtr++;
-        destPtr++;
-      }
-      sourcePtr += width - renderWidth;
-      destPtr += gb.display.width() - renderWidth;
-    }
+    target = cell;
+    search();
   }
-  else
+}
+
+void FlowField::invalidate()
+{
+  if (searching)
   {
-    // flip, copy pixel by pixel
-    for (uint8_t iy = 0; iy < renderHeight; iy++)
+    stale = true;
+    if (pendingTarget == FLOW_NO_CELL)
     {
-      for (uint8_t ix = 0; ix < renderWidth; ix++)
-      {
-        if (!transparentColor || *sourcePtr != transparentColor)
-        {
-          *destPtr = *sourcePtr;
-        }
-        sourcePtr--;
-        destPtr++;
-      }
-      sourcePtr += width + renderWidth;
-      destPtr += gb.display.width() - renderWidth;
+      pendingTarget = target;
     }
   }
+  else if (target != FLOW_NO_CELL)
+  {
+    search();
+  }
 }
 
-//-----------------------------------------------------------------------------
-// Anim
-//-----------------------------------------------------------------------------
+// starts over in the back buffer, the target is searched from even when it
+// is not walkable itself. The queue is allocated by update.
+void FlowField::search()
+{
+  memset(back, 0xFF, ((uint32_t)map->getWidth() * map->getHeight() + 1) / 2);
+  setFlow(back, target, FLOW_TARGET);
+  searching = true;
+  stale = false;
+}
 
-void Anim::init(const uint16_t *spriteData, const uint8_t* animData)
+// makes the ring at least the given size, false if out of memory
+bool FlowField::growQueue(uint16_t size)
 {
-  sprite.init(spriteData);
-  this->animData = animData;
-  currentAnim = NULL;
+  uint16_t* ring = (uint16_t*)malloc(size * sizeof(uint16_t));
+  if (ring == NULL)
+  {
+    return false;
+  }
+
+  // unroll the queued cells to the start
+  uint16_t index = head;
+  for (uint16_t i = 0; i < queued; i++)
+  {
+    ring[i] = queue[index];
+    if (++index == queueSize)
+    {
+      index = 0;
+    }
+  }
+
+  free(queue);
+  queue = ring;
+  queueSize = size;
+  head = 0;
+  return true;
 }
 
-void Anim::draw(int16_t x, int16_t y)
+void FlowField::update(uint16_t budget)
 {
-  if (currentAnim == NULL)
+  if (!searching)
   {
     return;
   }
 
-  sprite.frame = currentAnim[3 + currentFrameIndex] + frameOffset;
-  sprite.draw(x + this->originX, y + this->originY);
+  uint32_t start = micros();
+  int16_t width = map->getWidth();
+  int16_t height = map->getHeight();
+  uint16_t cells = width * height;
+  if (queue == NULL)
+  {
+    // the frontier of a breadth first search stays around the perimeter
+    uint32_t size = 4 * ((uint32_t)width + height);
+    queued = 0;
+    if (!growQueue(size < cells ? size : cells))
+    {
+      return; // tries again on the next update
+    }
+    queue[0] = target;
+    queued = 1;
+  }
 
-  uint8_t interval = currentAnim[2];
-  if (interval > 0)
+  uint16_t processed = 0;
+  while (queued > 0)
   {
-    if (++counter == interval)
+    // room for all the neighbors, every cell is queued once at most
+    if (queueSize < cells && queued + 8 > queueSize)
     {
-      if (++currentFrameIndex == currentAnim[0])
+      uint32_t size = 2 * (uint32_t)queueSize;
+      if (!growQueue(size < cells ? size : cells))
       {
-        if (currentAnim[1] == LOOP)
-        {
-          currentFrameIndex = 0;
-        }
-        else // currentAnim[1] == ONE_SHOT
-        {
-          currentAnim = NULL;
-        }
+        return;
+      }
+    }
+
+    uint16_t cell = queue[head];
+    if (++head == queueSize)
+    {
+      head = 0;
+    }
+    queued--;
+
+    int16_t x = cell % width;
+    int16_t y = cell / width;
+    for (uint8_t direction = 0; direction < 8; direction++)
+    {
+      int16_t nx = x + flowX[direction];
+      int16_t ny = y + flowY[direction];
+      if (nx < 0 || ny < 0 || nx >= width || ny >= height)
+      {
+        continue;
+      }
 
+      uint16_t next = ny * width + nx;
+      if (getFlow(back, next) != FLOW_NONE || !isWalkable(map->getTile(nx, ny)))
+      {
+        continue;
+      }
+      if (direction >= FLOW_SOUTH_EAST && (!isWalkable(map->getTile(nx, y)) || !isWalkable(map->getTile(x, ny))))
+      {
+        continue;
       }
-      counter = 0;
+
+      // the next cell points back to the one it was reached from
+      setFlow(back, next, direction ^ 2);
+      uint32_t tail = (uint32_t)head + queued;
+      queue[tail < queueSize ? tail : tail - queueSize] = next;
+      queued++;
+    }
+
+    if (++processed % FLOW_CHECK_INTERVAL == 0 && micros() - start >= budget)
+    {
+      return;
     }
   }
-}
 
-void Anim::play(uint8_t anim)
-{
-  currentAnim = animData;
-  for (uint8_t i = 0; i < anim; i++)
+  uint8_t* field = front;
+  front = back;
+  back = field;
+  searching = false;
+  free(queue);
+  queue = NULL;
+  queueSize = 0;
+
+  if (pendingTarget != FLOW_NO_CELL)
   {
-    currentAnim += 3 + currentAnim[0];
+    target = pendingTarget;
+    pendingTarget = FLOW_NO_CELL;
+    search();
   }
-  currentFrameIndex = 0;
-  counter = 0;
 }
 
-//-----------------------------------------------------------------------------
-// Tilemap
-//-----------------------------------------------------------------------------
-
-void Tilemap::init(const int16_t* mapData, const uint16_t* tilesetData)
+uint8_t FlowField::getDirection(int16_t x, int16_t y) const
 {
-  Tilemap::width = (uint8_t) *(mapData++);
-  Tilemap::height = (uint8_t) *(mapData++);
-  data = mapData;
-  tileset.init(tilesetData);
+  uint16_t cell = getCell(x, y);
+  return cell == FLOW_NO_CELL ? FLOW_NONE : getFlow(front, cell);
 }
 
-void Tilemap::draw(int16_t x, int16_t y)
+bool FlowField::getStep(int16_t x, int16_t y, int8_t& dx, int8_t& dy) const
 {
-  x += this->originX;
-  y += this->originY;
-
-  int16_t startX = -x / getTileWidth();
-  int16_t startY = -y / getTileHeight();
-  int16_t endX = startX + gbx::width / getTileWidth() + 1;
-  int16_t endY = startY + gbx::height / getTileHeight() + 1;
-  if (startX < 0) startX = 0;
-  if (startY < 0) startY = 0;
-  if (endX > width) endX = width;
-  if (endY > height) endY = height;
-  for (int16_t ix = startX; ix < endX; ix++)
+  uint8_t direction = getDirection(x, y);
+  if (direction >= FLOW_TARGET)
   {
-    for (int16_t iy = startY; iy < endY; iy++)
-    {
-      int16_t tid = getTile(ix, iy);
-      if (tid >= 0)
-      {
-        tileset.frame = tid;
-        tileset.draw(ix * getTileWidth() + x, iy * getTileHeight() + y);
-      }
-    }
+    dx = 0;
+    dy = 0;
+    return false;
   }
+  dx = flowX[direction];
+  dy = flowY[direction];
+  return true;
 }
+#endif
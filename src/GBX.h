@@ -14,10 +14,75 @@
 //
 
 #define DEFAULT_FRAME_RATE 30
+#define DEFAULT_MAX_FRAME_SKIP 2
 
 #define TYPES_INITIAL_CAPACITY 5
 #define LAYERS_INITIAL_CAPACITY 5
 #define RENDERABLES_BY_LAYER_INITIAL_CAPACITY 5
+#define TRIGGERS_INITIAL_CAPACITY 4
+#define DATA_POOL_MAX_SYSTEMS 4
+#define TRIGGER_MAX_OCCUPANTS 4
+#define SCENE_STACK_SIZE 4
+
+#define STREAMING_TILEMAP_SPARE_CHUNKS 2 // cached besides the chunks the screen can show
+#define STREAMING_TILEMAP_LOOKAHEAD 16
+#define STREAMING_TILEMAP_LOADS_PER_FRAME 1
+
+#define LABEL_CAPACITY 16
+#define LABEL_MAX_HEIGHT 8
+
+#define WIDGET_TRANSPARENT_COLOR 0xF81F
+#define WIDGET_MAX_DIRTY_RECTS 4
+
+// The features below can be switched with build flags (for example
+// -DPROFILER=1), the debug instrumentation is compiled out by default.
+
+#ifndef POST_EFFECTS
+#define POST_EFFECTS 1 // set to 0 to compile out fade, tint, flash and shake
+#endif
+
+#ifndef PATHFINDING
+#define PATHFINDING 1 // set to 0 to compile out the flow fields
+#endif
+#define FLOW_FIELD_BUDGET 1000 // default search time per update, in microseconds
+
+#ifndef STRIP_RENDERER
+#define STRIP_RENDERER 1 // set to 0 to compile out the strip renderer (160x128 mode)
+#endif
+#define STRIP_DEFAULT_HEIGHT 8
+
+#ifndef AUDIO
+#define AUDIO 1 // set to 0 to compile out the sound effect voices and music player
+#endif
+#define AUDIO_VOICES 3 // sound effect voices, the music uses one more sound channel
+
+#ifndef SAVE_STATES
+#define SAVE_STATES 1 // set to 0 to compile out the scene save states
+#endif
+#define SAVE_BUFFER_SIZE 512
+
+#ifndef PROFILER
+#define PROFILER 0 // set to 1 to compile in the frame profiler
+#endif
+#define PROFILER_FRAMES 32
+#define PROFILER_MAX_POOLS 8
+#define PROFILER_MAX_LAYERS 8
+
+#ifndef CAPTURE
+#define CAPTURE 0 // set to 1 to compile in the frame capture
+#endif
+#define CAPTURE_POOLS 8
+#define CAPTURE_BUFFER_SIZE 512
+
+#ifndef INPUT_REPLAY
+#define INPUT_REPLAY 0 // set to 1 to compile in input recording and replay
+#endif
+#define INPUT_BUFFER_SIZE 64
+
+#ifndef COLLISION_STATS
+#define COLLISION_STATS 0 // set to 1 to compile in the query counters
+#endif
+#define COLLISION_STATS_TYPES 8
 
 #include <Gamebuino-Meta.h> // FIXME should be only included in cpp
 
@@ -124,12 +189,41 @@ private:
 };
 
 
+//-----------------------------------------------------------------------------
+// Rect
+//-----------------------------------------------------------------------------
+
+struct Rect
+{
+  int16_t x;
+  int16_t y;
+  int16_t w;
+  int16_t h;
+
+  inline bool isEmpty() const
+  {
+    return w <= 0 || h <= 0;
+  }
+
+  inline bool intersects(const Rect& other) const
+  {
+    return x < other.x + other.w && other.x < x + w && y < other.y + other.h && other.y < y + h;
+  }
+
+  Rect intersection(const Rect& other) const;
+  Rect merge(const Rect& other) const;
+};
+
 //-----------------------------------------------------------------------------
 // Renderable
 //-----------------------------------------------------------------------------
 
 struct IRenderable
 {
+  virtual ~IRenderable()
+  {
+  }
+
   virtual void draw(int16_t x, int16_t y) = 0;
 };
 
@@ -152,6 +246,101 @@ public:
   int16_t originY;
 };
 
+//-----------------------------------------------------------------------------
+// Save states
+//-----------------------------------------------------------------------------
+
+#if SAVE_STATES
+#define SAVE_VERSION 1
+#define SAVE_NO_TARGET 0xFF
+#define SAVE_OTHER_TARGET 0xFE // camera target outside of the pools, left as is
+
+// Byte streams used by Scene::saveState and Scene::loadState. Errors are
+// sticky: after a failed write or read hasFailed() stays true, failed reads
+// give zeros.
+
+class StateWriter
+{
+public:
+  virtual void write(const void* data, uint16_t length) = 0;
+
+  template<class T>
+  inline void writeValue(const T& value)
+  {
+    write(&value, sizeof(T));
+  }
+
+  inline bool hasFailed() const
+  {
+    return failed;
+  }
+
+protected:
+  bool failed = false;
+};
+
+class StateReader
+{
+public:
+  virtual void read(void* data, uint16_t length) = 0;
+
+  template<class T>
+  inline void readValue(T& value)
+  {
+    read(&value, sizeof(T));
+  }
+
+  inline bool hasFailed() const
+  {
+    return failed;
+  }
+
+  // for loaders finding invalid data, the reads that follow fail as well
+  inline void fail()
+  {
+    failed = true;
+  }
+
+protected:
+  bool failed = false;
+};
+
+// State kept in memory (no allocation), fast enough to save every few frames
+// into a ring of buffers for instant replay or rewind.
+class StateBuffer : public StateWriter, public StateReader
+{
+public:
+  StateBuffer(uint8_t* data, uint16_t capacity) :
+    data(data),
+    capacity(capacity)
+  {
+  }
+
+  void write(const void* data, uint16_t length);
+  void read(void* data, uint16_t length);
+
+  void clear(); // writing starts over
+  void rewind(); // reading starts over
+
+  inline uint16_t getSize() const
+  {
+    return size;
+  }
+
+  inline bool hasFailed() const
+  {
+    return StateWriter::failed || StateReader::failed;
+  }
+
+  uint8_t* const data;
+  const uint16_t capacity;
+
+private:
+  uint16_t size = 0;
+  uint16_t position = 0;
+};
+#endif
+
 //-----------------------------------------------------------------------------
 // Entity
 //-----------------------------------------------------------------------------
@@ -199,6 +388,12 @@ public:
     return flags & flag;
   }
 
+  // counts the spawns in this slot, tells a respawned entity from the removed one
+  inline uint8_t getGeneration() const
+  {
+    return generation;
+  }
+
   uint8_t getType();
 
   int8_t hitboxX = 0;
@@ -212,6 +407,7 @@ public:
     hitboxY = y;
     hitboxWidth = width;
     hitboxHeight = height;
+    updateBounds();
   }
 
   void setHitbox(uint8_t width, uint8_t height)
@@ -219,12 +415,39 @@ public:
     setHitbox(0, 0, width, height);
   }
 
+  // Queries test the hitbox first and call collide only on a hit, so an
+  // override can narrow the hitbox (pixel tests, round shapes) but not reach
+  // beyond it: make the hitbox cover the whole shape.
   virtual bool collide(int16_t x, int16_t y, uint16_t w, uint16_t h) const;
   Entity* query(int16_t x, int16_t y, const uint8_t collideTypeIds[]) const;
 
   void moveBy(int16_t dx, int16_t dy, const uint8_t collideTypeIds[] = NULL);
   void moveTo(int16_t x, int16_t y, const uint8_t collideTypeIds[] = NULL);
 
+  inline void setPosition(int16_t x, int16_t y)
+  {
+    this->x = x;
+    this->y = y;
+    updateBounds();
+  }
+
+  // World space hitbox used by the queries, refreshed by every overlaps test
+  // so that x and y can be written directly, for example by the scene or in
+  // a collision callback.
+  inline void updateBounds()
+  {
+    boundsLeft = x + hitboxX;
+    boundsTop = y + hitboxY;
+    boundsRight = boundsLeft + hitboxWidth;
+    boundsBottom = boundsTop + hitboxHeight;
+  }
+
+  inline bool overlaps(int16_t left, int16_t top, int16_t right, int16_t bottom)
+  {
+    updateBounds();
+    return boundsLeft < right && left < boundsRight && boundsTop < bottom && top < boundsBottom;
+  }
+
   inline int16_t left()
   {
     return x + hitboxX;
@@ -252,6 +475,19 @@ public:
   {
   }
 
+#if SAVE_STATES
+  // State of the subclass, saved after the position and flags and read back
+  // in the same order. onInit runs before onLoadState for an entity that was
+  // not active.
+  virtual void onSaveState(StateWriter& out)
+  {
+  }
+
+  virtual void onLoadState(StateReader& in)
+  {
+  }
+#endif
+
 protected:
   virtual bool onMoveCollideX(Entity& other)
   {
@@ -265,9 +501,19 @@ protected:
 
 private:
   uint8_t flags = 0;
+  uint8_t generation = 0;
+  int16_t boundsLeft = 0;
+  int16_t boundsTop = 0;
+  int16_t boundsRight = 0;
+  int16_t boundsBottom = 0;
 
 public:
   void _init(int16_t x = 0, int16_t y = 0); // FIXME use friend
+#if SAVE_STATES
+  void _save(StateWriter& out); // FIXME use friend
+  void _load(StateReader& in); // FIXME use friend
+  void _deactivate(); // FIXME use friend
+#endif
   IEntityPool * _pool = NULL; // FIXME use friend
 };
 
@@ -275,16 +521,51 @@ public:
 // EntityPool
 //-----------------------------------------------------------------------------
 
+// Query counters by (querier type, target type). Queries that are not made by
+// an entity (for example Scene::query called from game code) are counted in
+// the QUERIER_NONE row.
+
+#define QUERIER_NONE COLLISION_STATS_TYPES
+
+#define ACTIVITY_ALWAYS -1
+#define DRAW_ALWAYS -1
+
+struct CollisionStats
+{
+  uint32_t calls; // per pixel moves can run thousands of queries a frame
+  uint32_t candidates;
+  uint32_t hits;
+};
+
+namespace gbx
+{
+  extern int16_t width;
+  extern int16_t height;
+  const Rect& getView(); // screen rectangle being drawn, renderables skip what is outside
+#if COLLISION_STATS
+  void _countQuery(uint8_t targetType, uint16_t candidates, bool hit);
+#endif
+}
+
 struct IEntityPool : public IRenderable
 {
   virtual void remove(Entity* entity) = 0;
 
   virtual uint8_t getType() const = 0;
   virtual uint8_t getLayer() const = 0;
+  virtual uint16_t getCount() const = 0;
+  virtual uint16_t getSize() const = 0;
+  virtual Entity* getEntity(uint16_t index) = 0; // NULL if not active
 
-  virtual void update() = 0; 
+  virtual void update(const Rect& view) = 0; // view is the camera rectangle
   virtual void drawDebug(int16_t cameraX, int16_t cameraY) = 0;
   virtual Entity* query(int16_t x, int16_t y, uint16_t w, uint16_t h) = 0; // FIXME const  
+  virtual uint16_t queryAll(int16_t x, int16_t y, uint16_t w, uint16_t h, Entity** found, uint16_t max) = 0; // number of hits, at most max stored
+
+#if SAVE_STATES
+  virtual void saveState(StateWriter& out) = 0;
+  virtual void loadState(StateReader& in) = 0;
+#endif
 };
 
 struct IScene
@@ -321,6 +602,7 @@ public:
     {
       pool[i].setFlag(_FLAG_ACTIVE, false);
     }
+    count = 0;
   } 
 
   T* spawn(int16_t x = 0, int16_t y = 0)
@@ -329,6 +611,7 @@ public:
     {
       if (!pool[i].getFlag(_FLAG_ACTIVE))
       {
+        count++;
         pool[i]._init(x, y);
         return &pool[i];
       }
@@ -343,7 +626,11 @@ public:
     {
       if (&pool[i] == entity)
       {
-        pool[i].setFlag(_FLAG_ACTIVE, false);
+        if (pool[i].getFlag(_FLAG_ACTIVE))
+        {
+          pool[i].setFlag(_FLAG_ACTIVE, false);
+          count--;
+        }
         return;
       }
     }
@@ -364,22 +651,72 @@ public:
     return layer;
   }
 
-  void update()
+  uint16_t getCount() const
+  {
+    return count;
+  }
+
+  uint16_t getSize() const
+  {
+    return size;
+  }
+
+  Entity* getEntity(uint16_t index)
+  {
+    return pool[index].getFlag(_FLAG_ACTIVE) ? &pool[index] : NULL;
+  }
+
+  // Entities further than margin pixels from the view are dormant: they are
+  // not updated and queries skip them. ACTIVITY_ALWAYS disables it.
+  void setActivityMargin(int16_t margin)
+  {
+    activityMargin = margin;
+  }
+
+  // Entities whose hitbox is further than margin pixels from the view are
+  // not drawn, the margin must cover what draw() paints outside the hitbox.
+  // DRAW_ALWAYS (the default) draws them all.
+  void setDrawMargin(int16_t margin)
+  {
+    drawMargin = margin;
+  }
+
+  inline bool isAwake(const Entity* entity) const
+  {
+    return activityMargin == ACTIVITY_ALWAYS || (entity->x >= activeLeft && entity->x < activeRight &&
+      entity->y >= activeTop && entity->y < activeBottom);
+  }
+
+  void update(const Rect& view)
   {
+    activeLeft = view.x - activityMargin;
+    activeTop = view.y - activityMargin;
+    activeRight = view.x + view.w + activityMargin;
+    activeBottom = view.y + view.h + activityMargin;
+
     for (T* entity = begin(); entity < end(); entity++)
     {     
-      if (entity->getFlag(_FLAG_ACTIVE))
+      if (entity->getFlag(_FLAG_ACTIVE) && isAwake(entity))
       {
         entity->update();
+        entity->updateBounds();
       }
     }
   }
 
   void draw(int16_t x, int16_t y)
   {
+    // the view in world space grown by the margin
+    const Rect& view = gbx::getView();
+    int16_t left = view.x - x - drawMargin;
+    int16_t top = view.y - y - drawMargin;
+    int16_t right = view.x + view.w - x + drawMargin;
+    int16_t bottom = view.y + view.h - y + drawMargin;
     for (T* entity = begin(); entity < end(); entity++)
     {      
-      if (entity->getFlag(_FLAG_ACTIVE) && entity->getFlag(FLAG_VISIBLE))
+      if (entity->getFlag(_FLAG_ACTIVE) && entity->getFlag(FLAG_VISIBLE) &&
+        (drawMargin == DRAW_ALWAYS || (entity->left() < right && left < entity->right() &&
+        entity->top() < bottom && top < entity->bottom())))
       {
         entity->draw(entity->x + x, entity->y + y);
       }
@@ -399,23 +736,119 @@ public:
 
   Entity* query(int16_t x, int16_t y, uint16_t w, uint16_t h)
   {
+#if COLLISION_STATS
+    uint16_t candidates = 0;
+#endif
+    int16_t right = x + w;
+    int16_t bottom = y + h;
     for (T* entity = begin(); entity < end(); entity++)
     {      
-      if (entity->getFlag(_FLAG_ACTIVE) && entity->getFlag(FLAG_COLLIDABLE) && entity->collide(x, y, w, h))
+      if (entity->getFlag(_FLAG_ACTIVE) && entity->getFlag(FLAG_COLLIDABLE) && isAwake(entity))
       {
-        return entity;
+#if COLLISION_STATS
+        candidates++;
+#endif
+        // cached bounds first, collide() may be overridden with a finer test
+        if (entity->overlaps(x, y, right, bottom) && entity->collide(x, y, w, h))
+        {
+#if COLLISION_STATS
+          gbx::_countQuery(type, candidates, true);
+#endif
+          return entity;
+        }
       }
     }
 
+#if COLLISION_STATS
+    gbx::_countQuery(type, candidates, false);
+#endif
     return NULL;
   }
 
+  uint16_t queryAll(int16_t x, int16_t y, uint16_t w, uint16_t h, Entity** found, uint16_t max)
+  {
+    uint16_t hits = 0;
+    int16_t right = x + w;
+    int16_t bottom = y + h;
+    for (T* entity = begin(); entity < end(); entity++)
+    {
+      if (entity->getFlag(_FLAG_ACTIVE) && entity->getFlag(FLAG_COLLIDABLE) && isAwake(entity) &&
+        entity->overlaps(x, y, right, bottom) && entity->collide(x, y, w, h))
+      {
+        if (hits < max)
+        {
+          found[hits] = entity;
+        }
+        hits++;
+      }
+    }
+    return hits;
+  }
+
+#if SAVE_STATES
+  // slots 8 at a time: a mask of the active ones, then their state
+  void saveState(StateWriter& out)
+  {
+    for (uint16_t group = 0; group < size; group += 8)
+    {
+      uint16_t last = size - group < 8 ? size : group + 8;
+      uint8_t mask = 0;
+      for (uint16_t i = group; i < last; i++)
+      {
+        if (pool[i].getFlag(_FLAG_ACTIVE))
+        {
+          mask |= 1 << (i - group);
+        }
+      }
+
+      out.writeValue(mask);
+      for (uint16_t i = group; i < last; i++)
+      {
+        if (mask & (1 << (i - group)))
+        {
+          pool[i]._save(out);
+        }
+      }
+    }
+  }
+
+  void loadState(StateReader& in)
+  {
+    count = 0;
+    for (uint16_t group = 0; group < size; group += 8)
+    {
+      uint16_t last = size - group < 8 ? size : group + 8;
+      uint8_t mask;
+      in.readValue(mask);
+      for (uint16_t i = group; i < last; i++)
+      {
+        if (mask & (1 << (i - group)))
+        {
+          pool[i]._load(in);
+          count++;
+        }
+        else
+        {
+          pool[i]._deactivate();
+        }
+      }
+    }
+  }
+#endif
+
 private:
   IScene* const scene;
   const uint8_t type;
   const uint8_t layer;
   const uint16_t size;
+  uint16_t count = 0;
   T* pool;
+  int16_t activityMargin = ACTIVITY_ALWAYS;
+  int16_t drawMargin = DRAW_ALWAYS;
+  int16_t activeLeft = 0;
+  int16_t activeTop = 0;
+  int16_t activeRight = 0;
+  int16_t activeBottom = 0;
 
   T* begin()
   {
@@ -429,82 +862,377 @@ private:
 };
 
 //-----------------------------------------------------------------------------
-// Scene
+// DataPool
 //-----------------------------------------------------------------------------
 
-class Scene : public IScene
-{
-public:
-  Scene();
-  virtual ~Scene();
+// Data oriented pool: instead of Entity objects with a virtual update, the
+// pool holds one array per component and runs system functions over them.
+// The arrays are kept packed, live entities are at indexes 0 to getCount() - 1
+// and removing one moves the last entity into its slot (iterate backwards
+// when removing from a system). All entities share the pool's hitbox and
+// sprite, the sprite frame comes from the frame array. Scene queries return
+// a handle Entity placed on the hit, getIndex() gives its index. The
+// constructor allocates the arrays through init, getSize() is 0 if it failed.
 
-  void init();
-  virtual void onInit()
-  {
-  }
+class Sprite;
 
-  virtual void update();
-  virtual void draw();
-  virtual void drawDebug();
+class DataPool : public IEntityPool
+{
+public:
+  typedef void (*System)(DataPool& pool);
 
-  int16_t cameraX = 0;
-  int16_t cameraY = 0;
+  DataPool(IScene* scene, uint8_t type, uint16_t size, uint8_t layer = 0);
+  virtual ~DataPool();
 
-  void add(IRenderable& renderable, uint8_t layer = 0);
-  // TODO remove(IRenderable* renderable);
+  bool init(uint16_t size); // clears the pool, false if out of memory
 
-  Entity* query(int16_t x, int16_t y, uint16_t w, uint16_t h, uint8_t entityType); // FIXME const;
-  Entity* query(int16_t x, int16_t y, uint16_t w, uint16_t h, const uint8_t entityTypes[]); // FIXME const;
+  int16_t spawn(int16_t x = 0, int16_t y = 0); // index, -1 if full
+  void remove(uint16_t index);
+  void remove(Entity* entity);
+  void clear();
 
-private:
-  PtrVector<IEntityPool> pools;
+  bool addSystem(System system);
 
-public:
-  void _addPool(IEntityPool* pool); // FIXME friend
-};
+  void setHitbox(int8_t x, int8_t y, uint8_t width, uint8_t height);
 
-//-----------------------------------------------------------------------------
-// Sprite
-//-----------------------------------------------------------------------------
+  inline void setSprite(Sprite* sprite)
+  {
+    this->sprite = sprite;
+  }
 
-#define LOOP 0
-#define ONE_SHOT 1
+  inline int16_t getIndex(const Entity* entity) const
+  {
+    return entity == &handle ? handleIndex : -1;
+  }
 
-class Sprite : public Renderable
-{
-public:
-  Sprite(int16_t originX = 0, int16_t originY = 0) :
-    Renderable(originX, originY)
+  uint8_t getType() const
   {
+    return type;
   }
 
-  Sprite(const uint16_t *data, int16_t originX = 0, int16_t originY = 0) :
-    Sprite(originX, originY)
+  uint8_t getLayer() const
   {
-    init(data);
+    return layer;
   }
 
-  virtual void init(const uint16_t *data);
+  uint16_t getCount() const
+  {
+    return count;
+  }
 
-  virtual void draw(int16_t x, int16_t y);
+  uint16_t getSize() const
+  {
+    return size;
+  }
 
-  inline uint16_t getWidth() const
+  Entity* getEntity(uint16_t index)
   {
-    return width;
+    return NULL; // entities have no Entity object, not supported by triggers
   }
 
-  inline uint16_t getHeight() const
+  void update(const Rect& view); // systems run over all entities, no dormancy
+  void draw(int16_t x, int16_t y);
+  void drawDebug(int16_t x, int16_t y);
+  Entity* query(int16_t x, int16_t y, uint16_t w, uint16_t h);
+
+  uint16_t queryAll(int16_t x, int16_t y, uint16_t w, uint16_t h, Entity** found, uint16_t max)
   {
-    return height;
+    return 0; // see getEntity
   }
 
-  uint16_t frame = 0;
-  bool flip = false;
+  static void applyVelocity(DataPool& pool); // system adding vx, vy to x, y
 
-protected:
-  const uint16_t* buffer = NULL;
-  uint16_t width = 0;
-  uint16_t height = 0;
+#if SAVE_STATES
+  void saveState(StateWriter& out); // count then the component arrays
+  void loadState(StateReader& in);
+#endif
+
+  // components, valid up to getCount()
+  int16_t* x = NULL;
+  int16_t* y = NULL;
+  int16_t* vx = NULL;
+  int16_t* vy = NULL;
+  uint8_t* frame = NULL;
+  uint8_t* state = NULL; // free for game code
+
+private:
+  const uint8_t type;
+  const uint8_t layer;
+  uint16_t size = 0;
+  uint16_t count = 0;
+  System systems[DATA_POOL_MAX_SYSTEMS];
+  uint8_t systemCount = 0;
+  Sprite* sprite = NULL;
+  Entity handle;
+  int16_t handleIndex = -1;
+};
+
+//-----------------------------------------------------------------------------
+// Trigger
+//-----------------------------------------------------------------------------
+
+// Non blocking region watching the awake, collidable entities of one pool.
+// The Scene checks its triggers after updating the pools, through the pool
+// queries, and calls onEnter/onExit only when an entity starts or stops
+// overlapping the region. Removed entities exit, an entity respawned in the
+// slot of an occupant is a new one (onExit gets the slot, already holding
+// it). At most TRIGGER_MAX_OCCUPANTS entities are tracked at once: the
+// others get onEnter only once a slot frees up, hasOverflowed() tells when
+// the last check left some out.
+
+class Trigger
+{
+public:
+  Trigger(int16_t x, int16_t y, uint16_t w, uint16_t h, uint8_t entityType) :
+    x(x),
+    y(y),
+    w(w),
+    h(h),
+    entityType(entityType)
+  {
+  }
+
+  virtual void onEnter(Entity& entity)
+  {
+  }
+
+  virtual void onExit(Entity& entity)
+  {
+  }
+
+  inline uint8_t getOccupantCount() const
+  {
+    return occupantCount;
+  }
+
+  inline bool hasOverflowed() const
+  {
+    return overflowed;
+  }
+
+  int16_t x;
+  int16_t y;
+  uint16_t w;
+  uint16_t h;
+  const uint8_t entityType;
+
+private:
+  friend class Scene;
+
+  void reset()
+  {
+    occupantCount = 0;
+    overflowed = false;
+  }
+
+  void check(IEntityPool& pool, bool silent = false); // silent: no events, after loading a state
+
+  Entity* occupants[TRIGGER_MAX_OCCUPANTS];
+  uint8_t generations[TRIGGER_MAX_OCCUPANTS];
+  uint8_t occupantCount = 0;
+  bool overflowed = false;
+};
+
+//-----------------------------------------------------------------------------
+// Scene
+//-----------------------------------------------------------------------------
+
+// Camera driving Scene::cameraX/cameraY once it follows a target or was
+// moved. The target is kept inside a deadzone centered on the screen, the
+// camera moves by smoothing/256 of the remaining distance every tick
+// (CAMERA_SNAP moves at once) and stays inside the bounds if any.
+
+#define CAMERA_SNAP 256
+
+class Camera
+{
+public:
+  void follow(const Entity* target, int16_t offsetX = 0, int16_t offsetY = 0);
+  void moveTo(int16_t x, int16_t y); // snaps, ignores the smoothing
+
+  void setDeadzone(uint8_t width, uint8_t height);
+  void setSmoothing(uint16_t smoothing);
+  void setBounds(int16_t x, int16_t y, int16_t w, int16_t h);
+  void clearBounds();
+
+  inline int16_t getX() const
+  {
+    return (posX + 128) >> 8;
+  }
+
+  inline int16_t getY() const
+  {
+    return (posY + 128) >> 8;
+  }
+
+  Rect getView() const; // world rectangle on screen
+
+  bool update(); // returns false while the camera is not used
+
+private:
+  friend class Scene;
+
+  void clamp();
+
+  const Entity* target = NULL;
+  int16_t offsetX = 0;
+  int16_t offsetY = 0;
+  int32_t posX = 0; // 8.8 fixed point
+  int32_t posY = 0;
+  uint8_t deadzoneWidth = 0;
+  uint8_t deadzoneHeight = 0;
+  uint16_t smoothing = CAMERA_SNAP;
+  Rect bounds = { 0, 0, 0, 0 };
+  bool active = false;
+};
+
+// Layers are drawn with the camera position scaled by their scroll factors
+// (8.8 fixed point, SCROLL_FULL follows the camera, 0 stays fixed on screen)
+// plus their offset, for parallax backgrounds and HUD layers.
+
+#define SCROLL_FULL 256
+
+#define SCENE_LIVE 0 // the scene below keeps updating and is drawn
+#define SCENE_PAUSE 1 // the scene below is only drawn, its tick and animations stand still
+#define SCENE_SNAPSHOT 2 // the scene below is frozen, the screen is restored from a copy
+
+class Scene : public IScene
+{
+public:
+  Scene();
+  virtual ~Scene();
+
+  void init();
+  virtual void onInit()
+  {
+  }
+
+  // loading steps run by gbx::loadScene after init
+  virtual uint16_t getLoadSteps()
+  {
+    return 0;
+  }
+
+  virtual void onLoad(uint16_t step)
+  {
+  }
+
+  virtual void drawLoading(uint16_t done, uint16_t total);
+
+  virtual void update();
+  virtual void draw();
+  virtual void drawDebug();
+
+  int16_t cameraX = 0;
+  int16_t cameraY = 0;
+  Camera camera;
+
+  void add(IRenderable& renderable, uint8_t layer = 0);
+  // TODO remove(IRenderable* renderable);
+
+  void setLayerScroll(uint8_t layer, int16_t scrollX, int16_t scrollY, int16_t offsetX = 0, int16_t offsetY = 0);
+
+  void addTrigger(Trigger& trigger);
+
+  Entity* query(int16_t x, int16_t y, uint16_t w, uint16_t h, uint8_t entityType); // FIXME const;
+  Entity* query(int16_t x, int16_t y, uint16_t w, uint16_t h, const uint8_t entityTypes[]); // FIXME const;
+
+  IEntityPool* getPool(uint8_t type);
+
+  // number of updates of this scene so far, it stands still while the scene
+  // is paused under another one
+  inline uint32_t getTick() const
+  {
+    return tick;
+  }
+
+#if SAVE_STATES
+  // Snapshot of the pools (active slots, positions, flags and the entity
+  // payloads), the camera and the onSaveState payload. Loading expects the
+  // same pools and returns false otherwise or when the data runs out, the
+  // scene is then partly loaded and should be initialized again. The trigger
+  // occupants are taken from the loaded positions without onEnter/onExit.
+  bool saveState(StateWriter& out);
+  bool loadState(StateReader& in);
+
+  virtual void onSaveState(StateWriter& out)
+  {
+  }
+
+  virtual void onLoadState(StateReader& in)
+  {
+  }
+#endif
+
+private:
+  struct Layer
+  {
+    Layer() :
+      renderables(RENDERABLES_BY_LAYER_INITIAL_CAPACITY)
+    {
+    }
+
+    PtrVector<IRenderable> renderables;
+    int16_t scrollX = SCROLL_FULL;
+    int16_t scrollY = SCROLL_FULL;
+    int16_t offsetX = 0;
+    int16_t offsetY = 0;
+  };
+
+  Layer* getLayer(uint8_t layer);
+
+  PtrVector<IEntityPool> pools;
+  PtrVector<Layer> layers;
+  PtrVector<Trigger> triggers;
+  uint32_t tick = 0;
+
+public:
+  void _addPool(IEntityPool* pool); // FIXME friend
+  void _update(); // update() then counts the tick, FIXME friend
+};
+
+//-----------------------------------------------------------------------------
+// Sprite
+//-----------------------------------------------------------------------------
+
+#define LOOP 0
+#define ONE_SHOT 1
+
+class Sprite : public Renderable
+{
+public:
+  Sprite(int16_t originX = 0, int16_t originY = 0) :
+    Renderable(originX, originY)
+  {
+  }
+
+  Sprite(const uint16_t *data, int16_t originX = 0, int16_t originY = 0) :
+    Sprite(originX, originY)
+  {
+    init(data);
+  }
+
+  virtual void init(const uint16_t *data);
+
+  virtual void draw(int16_t x, int16_t y);
+
+  inline uint16_t getWidth() const
+  {
+    return width;
+  }
+
+  inline uint16_t getHeight() const
+  {
+    return height;
+  }
+
+  uint16_t frame = 0;
+  bool flip = false;
+
+protected:
+  const uint16_t* buffer = NULL;
+  uint16_t width = 0;
+  uint16_t height = 0;
   uint16_t transparentColor = 0;
 };
 
@@ -568,6 +1296,7 @@ private:
   const uint8_t* currentAnim;
   uint8_t currentFrameIndex;
   uint8_t counter;
+  uint16_t lastTick;
 
   Sprite sprite;
 };
@@ -576,14 +1305,62 @@ private:
 // Tilemap
 //-----------------------------------------------------------------------------
 
+// Tile id -> frame sequence table shared by tilemaps. The current frame of
+// every animated tile is computed once per tick, so drawing an animated cell
+// costs one lookup. Intervals are in ticks (scene updates).
+
+class AnimatedTiles
+{
+public:
+  AnimatedTiles(uint8_t capacity);
+  ~AnimatedTiles();
+
+  bool add(int16_t tile, const int16_t* frames, uint8_t frameCount, uint8_t interval); // false if full or out of memory
+
+  void update(); // called by the tilemaps before drawing
+
+  inline int16_t get(int16_t tile) const
+  {
+    uint16_t index = tile - firstTile;
+    return index < tileCount ? current[index] : tile;
+  }
+
+private:
+  struct Entry
+  {
+    int16_t tile;
+    const int16_t* frames;
+    uint8_t frameCount;
+    uint8_t interval;
+  };
+
+  Entry* entries;
+  uint8_t capacity;
+  uint8_t size = 0;
+  int16_t* current = NULL; // current frame by tile id, from firstTile
+  int16_t firstTile = 0;
+  uint16_t tileCount = 0;
+  uint32_t lastTick = UINT32_MAX;
+};
+
+// Map data is either int16_t cells (-1 is empty) or compact uint8_t cells
+// (TILE_EMPTY is empty), both prefixed by the width and height. Several
+// tilemaps can share one tileset Sprite, for example parallax layers. Only
+// init(mapData, tilesetData) allocates a Sprite of its own, freed with the
+// tilemap.
+
+#define TILE_EMPTY 0xFF
+
 class Tilemap : public Renderable
 {
 public:
   Tilemap(int16_t originX = 0, int16_t originY = 0) :
     Renderable(originX, originY),
     data(NULL),
+    compactData(NULL),
     width(0),
-    height(0)
+    height(0),
+    tileset(NULL)
   {
   }
 
@@ -593,40 +1370,716 @@ public:
     init(mapData, tilesetData);
   }
 
+  Tilemap(const uint8_t* mapData, Sprite& tileset, int16_t originX = 0, int16_t originY = 0) :
+    Tilemap(originX, originY)
+  {
+    init(mapData, tileset);
+  }
+
+  ~Tilemap()
+  {
+    delete ownTileset;
+  }
+
   void init(const int16_t* mapData, const uint16_t* tilesetData);
+  void init(const int16_t* mapData, Sprite& tileset);
+  void init(const uint8_t* mapData, Sprite& tileset);
 
   inline int16_t getTile(int16_t x, int16_t y) const
   {
+    if (compactData != NULL)
+    {
+      uint8_t tid = compactData[y * width + x];
+      return tid == TILE_EMPTY ? -1 : tid;
+    }
     return data[y * width + x];
   }
 
   void draw(int16_t x, int16_t y);
 
-  inline uint8_t getWidth() const
+  inline void setAnimatedTiles(AnimatedTiles* animatedTiles)
+  {
+    this->animatedTiles = animatedTiles;
+  }
+
+  inline uint16_t getWidth() const
   {
     return width;
   }
 
-  inline uint8_t getHeight() const
+  inline uint16_t getHeight() const
   {
     return height;
   }
 
   inline uint16_t getTileWidth() const
   {
-    return tileset.getWidth();
+    return tileset->getWidth();
   }
 
   inline uint16_t getTileHeight() const
   {
-    return tileset.getHeight();
+    return tileset->getHeight();
   }
 
 private:
   const int16_t* data;
-  uint8_t width;
+  const uint8_t* compactData;
+  uint16_t width;
+  uint16_t height;
+  Sprite* tileset;
+  Sprite* ownTileset = NULL; // allocated by init(mapData, tilesetData)
+  AnimatedTiles* animatedTiles = NULL;
+};
+
+// Tilemap read from a chunked map file, only the chunks around the view are
+// kept in memory: as many as the screen can show plus
+// STREAMING_TILEMAP_SPARE_CHUNKS, sized for the screen at open (call
+// gbx::setStripRendering first, a larger screen later grows the cache). The
+// chunks are loaded once per frame on the first draw, not per strip. Chunks in
+// the scrolling direction are loaded ahead, at most
+// STREAMING_TILEMAP_LOADS_PER_FRAME per frame. The map must fit in 32767
+// pixels per axis, open fails otherwise.
+//
+// Map file format (little endian), see tools/gbxmap.py:
+//   header: "GBXM", uint8 version, uint8 cell size (1 or 2), uint8 chunk size (tiles),
+//           uint8 reserved, uint16 width, uint16 height (tiles)
+//   chunks: row by row, each chunk is chunk size * chunk size cells row by row,
+//           int16 cells use -1 for empty and uint8 cells TILE_EMPTY (also used
+//           to pad the chunks on the edges)
+
+#define MAP_VERSION 1
+#define MAP_HEADER_SIZE 12
+
+class StreamingTilemap : public Renderable
+{
+public:
+  StreamingTilemap(int16_t originX = 0, int16_t originY = 0) :
+    Renderable(originX, originY)
+  {
+  }
+
+  virtual ~StreamingTilemap();
+
+  bool open(const char* path, Sprite& tileset);
+  void close();
+
+  int16_t getTile(int16_t x, int16_t y) const; // -1 if empty or not loaded
+
+  void draw(int16_t x, int16_t y);
+
+  inline void setAnimatedTiles(AnimatedTiles* animatedTiles)
+  {
+    this->animatedTiles = animatedTiles;
+  }
+
+  inline uint16_t getWidth() const
+  {
+    return width;
+  }
+
+  inline uint16_t getHeight() const
+  {
+    return height;
+  }
+
+  inline uint16_t getTileWidth() const
+  {
+    return tileset->getWidth();
+  }
+
+  inline uint16_t getTileHeight() const
+  {
+    return tileset->getHeight();
+  }
+
+private:
+  bool allocate();
+  void stream(int16_t x, int16_t y);
+  int8_t findChunk(int16_t chunkX, int16_t chunkY) const;
+  int8_t loadChunk(int16_t chunkX, int16_t chunkY);
+  void drawChunk(uint8_t slot, int16_t startX, int16_t startY, int16_t endX, int16_t endY, int16_t x, int16_t y);
+
+  File file;
+  uint8_t* cells = NULL;
+  uint8_t cellSize = 0;
+  int16_t* chunkX = NULL; // slot arrays and cells share one allocation
+  int16_t* chunkY;
+  uint16_t* lastUsed;
+  uint8_t slots = 0;
+  int16_t cacheWidth = 0; // screen size the slots were counted for
+  int16_t cacheHeight = 0;
+  uint32_t lastFrame = 0;
+  uint16_t drawCount = 0;
+  uint16_t width = 0;
+  uint16_t height = 0;
+  uint8_t chunkSize = 0;
+  int16_t lastX = 0;
+  int16_t lastY = 0;
+  Sprite* tileset = NULL;
+  AnimatedTiles* animatedTiles = NULL;
+};
+
+//-----------------------------------------------------------------------------
+// Pathfinding
+//-----------------------------------------------------------------------------
+
+#if PATHFINDING
+// Flow field over the cells of a Tilemap: every reachable cell stores the
+// direction of the next cell on a shortest path to the target, so any number
+// of entities chasing the same target share one breadth first search. The
+// search is spread over the calls to update() under a time budget and runs
+// in a second buffer, the previous field stays in use until it completes. A
+// target moving meanwhile is searched for once the current search is done.
+// Diagonal steps never cut the corner of a blocked cell. Uses one byte per
+// cell plus, while searching, a queue of 8 * (width + height) bytes that
+// grows on maps with many branches. Maps are limited to 65534 cells.
+
+#define FLOW_EAST 0
+#define FLOW_SOUTH 1
+#define FLOW_WEST 2
+#define FLOW_NORTH 3
+#define FLOW_SOUTH_EAST 4
+#define FLOW_SOUTH_WEST 5
+#define FLOW_NORTH_WEST 6
+#define FLOW_NORTH_EAST 7
+#define FLOW_TARGET 8
+#define FLOW_NONE 0xF // blocked, unreachable or outside of the map
+#define FLOW_NO_CELL 0xFFFF
+
+class FlowField
+{
+public:
+  ~FlowField();
+
+  bool init(const Tilemap& map); // false if out of memory
+  void setWalkable(int16_t tile, bool walkable); // only empty cells (-1) by default
+
+  void setTarget(int16_t x, int16_t y); // world position, searches again when the cell changed
+  void invalidate(); // the map or the walkable tiles changed, searches again
+  void update(uint16_t budget = FLOW_FIELD_BUDGET); // call once per tick
+
+  inline bool isSearching() const
+  {
+    return searching;
+  }
+
+  uint8_t getDirection(int16_t x, int16_t y) const; // world position
+  bool getStep(int16_t x, int16_t y, int8_t& dx, int8_t& dy) const; // false when there is no step
+
+private:
+  uint16_t getCell(int16_t x, int16_t y) const;
+  void search();
+  bool growQueue(uint16_t size);
+
+  inline bool isWalkable(int16_t tile) const
+  {
+    return tile < 0 ? walkableEmpty : tile < 256 && (walkableTiles[tile >> 3] & (1 << (tile & 7)));
+  }
+
+  const Tilemap* map = NULL;
+  uint8_t* front = NULL; // directions, two cells per byte
+  uint8_t* back = NULL;
+  uint16_t* queue = NULL; // ring of the search frontier, only while searching
+  uint16_t queueSize = 0;
+  uint16_t head = 0;
+  uint16_t queued = 0;
+  uint16_t target = FLOW_NO_CELL; // of the current search
+  uint16_t pendingTarget = FLOW_NO_CELL; // searched for after it
+  bool searching = false;
+  bool stale = false; // invalidated during the current search
+  bool walkableEmpty = true;
+  uint8_t walkableTiles[32] = {};
+};
+#endif
+
+//-----------------------------------------------------------------------------
+// Particles
+//-----------------------------------------------------------------------------
+
+// Particles are stored as arrays (positions, velocities, life) instead of
+// entities and plotted as single pixels. Positions and velocities are 8.8
+// fixed point (PARTICLE_ONE is one pixel), velocities in pixels per tick.
+// Particles are advanced once per tick when the emitter is drawn. The color
+// comes from the palette, indexed by the remaining life shifted right by
+// paletteShift, so the first color is the one of dying particles. The
+// constructor allocates the arrays through init, getCapacity() is 0 if it
+// failed.
+
+#define PARTICLE_ONE 256
+#define PARTICLE_MAX_STEPS 4 // ticks simulated at most per draw
+
+class ParticleEmitter : public Renderable
+{
+public:
+  ParticleEmitter(uint16_t capacity, int16_t originX = 0, int16_t originY = 0);
+  virtual ~ParticleEmitter();
+
+  bool init(uint16_t capacity); // clears the particles, false if out of memory
+
+  bool emit(int16_t x, int16_t y, int16_t vx, int16_t vy, uint8_t life);
+  void burst(int16_t x, int16_t y, uint8_t count, int16_t speed, uint8_t life); // random directions
+  void clear();
+
+  bool setPalette(const Color* colors, uint8_t count, uint8_t paletteShift = 0); // false if count is 0
+
+  inline uint16_t getCount() const
+  {
+    return count;
+  }
+
+  inline uint16_t getCapacity() const
+  {
+    return capacity;
+  }
+
+  void draw(int16_t x, int16_t y);
+
+  int16_t gravityX = 0; // added to the velocities every tick
+  int16_t gravityY = 0;
+
+private:
+  void step();
+
+  uint16_t capacity = 0;
+  uint16_t count = 0;
+  int32_t* posX = NULL;
+  int32_t* posY = NULL;
+  int16_t* velX = NULL;
+  int16_t* velY = NULL;
+  uint8_t* life = NULL;
+  const Color* palette = NULL;
+  uint8_t paletteCount = 0;
+  uint8_t paletteShift = 0;
+  uint32_t lastTick;
+};
+
+//-----------------------------------------------------------------------------
+// Text
+//-----------------------------------------------------------------------------
+
+#define ALIGN_LEFT 0
+#define ALIGN_CENTER 1
+#define ALIGN_RIGHT 2
+
+// Glyphs are stored as one byte per row, bit 0 is the leftmost pixel.
+struct Font
+{
+  uint8_t width; // max 8
   uint8_t height;
-  Sprite tileset;
+  uint8_t spacing;
+  uint8_t firstChar;
+  uint8_t charCount;
+  const uint8_t* glyphs;
+};
+
+namespace gbx
+{
+  extern const Font defaultFont;
+}
+
+// Text rasterized once and redrawn from the cached rows until it changes,
+// max 64 pixels wide.
+class Label : public Renderable
+{
+public:
+  Label(int16_t originX = 0, int16_t originY = 0);
+
+  Label(const char* text, int16_t originX = 0, int16_t originY = 0) :
+    Label(originX, originY)
+  {
+    setText(text);
+  }
+
+  void setText(const char* text);
+  void setInt(int32_t value, uint8_t minDigits = 0);
+
+  inline const char* getText() const
+  {
+    return text;
+  }
+
+  void setFont(const Font& font);
+  void setAlign(uint8_t align);
+
+  void draw(int16_t x, int16_t y);
+
+  inline uint8_t getWidth() const
+  {
+    return width;
+  }
+
+  inline uint8_t getHeight() const
+  {
+    return height;
+  }
+
+  Color color = Color::white;
+
+private:
+  void rasterize();
+
+  char text[LABEL_CAPACITY + 1];
+  const Font* font;
+  uint8_t align = ALIGN_LEFT;
+  uint8_t width = 0;
+  uint8_t height = 0;
+  uint32_t rows[LABEL_MAX_HEIGHT][2];
+};
+
+//-----------------------------------------------------------------------------
+// Canvas
+//-----------------------------------------------------------------------------
+
+// RGB565 pixel buffer with a clip rectangle, gbx::getCanvas() is the screen.
+// With setBuffer only part of the canvas is backed by memory (strip
+// rendering): buffer holds the pixels of bounds, row after row with a stride
+// of width, and the clip never leaves bounds.
+class Canvas
+{
+public:
+  Canvas(uint16_t* buffer = NULL, int16_t width = 0, int16_t height = 0);
+
+  void setBuffer(uint16_t* buffer, const Rect& bounds);
+
+  void setClip(const Rect& rect);
+  void resetClip();
+
+  inline const Rect& getClip() const
+  {
+    return clip;
+  }
+
+  inline const Rect& getBounds() const
+  {
+    return bounds;
+  }
+
+  void clear(Color c);
+  void setPixel(int16_t x, int16_t y, Color c);
+  Color getPixel(int16_t x, int16_t y) const;
+  void drawLine(int16_t x0, int16_t y0, int16_t x1, int16_t y1, Color c);
+  void fillRect(int16_t x, int16_t y, int16_t w, int16_t h, Color c);
+  void drawRect(int16_t x, int16_t y, int16_t w, int16_t h, Color c);
+  void drawCircle(int16_t x, int16_t y, int16_t r, Color c);
+  void fillCircle(int16_t x, int16_t y, int16_t r, Color c);
+  void drawMask(int16_t x, int16_t y, uint32_t mask, Color c); // bit 0 at x
+  void drawText(int16_t x, int16_t y, const char* str, Color c = Color::white, uint8_t align = ALIGN_LEFT, const Font& font = gbx::defaultFont);
+  void drawBuffer(int16_t x, int16_t y, const uint16_t* source, int16_t w, int16_t h, uint16_t transparentColor);
+
+  // address of a pixel inside bounds
+  inline uint16_t* getAddress(int16_t x, int16_t y) const
+  {
+    return buffer + (y - bounds.y) * width + (x - bounds.x);
+  }
+
+  uint16_t* buffer;
+  int16_t width;
+  int16_t height;
+
+private:
+  Rect bounds;
+  Rect clip;
+};
+
+//-----------------------------------------------------------------------------
+// Display sinks
+//-----------------------------------------------------------------------------
+
+#if STRIP_RENDERER
+// Receives the strips of the frames drawn with gbx::setStripRendering, top to
+// bottom. The renderer alternates two strip buffers: a strip must no longer be
+// used by the sink once the next call to writeStrip returns.
+class DisplaySink
+{
+public:
+  virtual void beginFrame()
+  {
+  }
+
+  virtual void writeStrip(uint16_t* pixels, int16_t y, int16_t width, int16_t height) = 0;
+
+  virtual void endFrame()
+  {
+  }
+};
+
+// Sends the strips to the screen with DMA, the next strip is drawn while the
+// previous one is transferred. The pixels are byte swapped in place.
+class TftSink : public DisplaySink
+{
+public:
+  void writeStrip(uint16_t* pixels, int16_t y, int16_t width, int16_t height);
+  void endFrame();
+
+private:
+  void wait();
+
+  bool pending = false;
+};
+
+// Copies the strips into a full frame buffer, to check the output or take
+// screenshots.
+class MemorySink : public DisplaySink
+{
+public:
+  MemorySink(uint16_t* buffer, int16_t width) :
+    buffer(buffer),
+    width(width)
+  {
+  }
+
+  void writeStrip(uint16_t* pixels, int16_t y, int16_t width, int16_t height);
+
+  uint16_t* buffer;
+  int16_t width;
+};
+#endif
+
+//-----------------------------------------------------------------------------
+// UI
+//-----------------------------------------------------------------------------
+
+// Retained widgets painted into the cache of their WidgetLayer. Only the
+// rectangles of widgets that changed since the last frame are repainted, the
+// cache is then blitted to the screen. Widget coordinates are relative to
+// the layer, the layer is drawn in screen space. Without memory for the cache
+// the widgets are painted straight to the screen every frame.
+
+class Widget
+{
+public:
+  Widget(int16_t x, int16_t y, int16_t width, int16_t height);
+
+  void add(Widget& child);
+  void invalidate();
+
+  void setPosition(int16_t x, int16_t y);
+  void setVisible(bool visible);
+
+  inline bool isVisible() const
+  {
+    return visible;
+  }
+
+  inline const Rect& getBounds() const
+  {
+    return bounds;
+  }
+
+protected:
+  virtual void paint(Canvas& canvas) = 0;
+
+  Rect bounds;
+
+private:
+  bool visible = true;
+  bool dirty = true;
+  Rect paintedBounds = {};
+  Widget* firstChild = NULL;
+  Widget* nextSibling = NULL;
+
+  friend class WidgetLayer;
+};
+
+class WidgetLayer : public Renderable
+{
+public:
+  WidgetLayer(int16_t x, int16_t y, int16_t width, int16_t height);
+  virtual ~WidgetLayer();
+
+  void add(Widget& widget);
+
+  void draw(int16_t x, int16_t y);
+
+private:
+  void collectDirty(Widget* widget, bool parentVisible, bool parentDirty);
+  void paint(Widget* widget, Canvas& target, const Rect& rect);
+  void addDirty(const Rect& rect);
+
+  Canvas canvas;
+  Widget* firstChild = NULL;
+  Rect dirtyRects[WIDGET_MAX_DIRTY_RECTS];
+  uint8_t dirtyCount = 0;
+};
+
+class PanelWidget : public Widget
+{
+public:
+  PanelWidget(int16_t x, int16_t y, int16_t width, int16_t height, Color background = Color::black, Color border = Color::white) :
+    Widget(x, y, width, height),
+    background(background),
+    border(border)
+  {
+  }
+
+  void setColors(Color background, Color border);
+
+protected:
+  void paint(Canvas& canvas);
+
+private:
+  Color background;
+  Color border;
+};
+
+class LabelWidget : public Widget
+{
+public:
+  LabelWidget(int16_t x, int16_t y, int16_t width, const char* text = "", Color color = Color::white);
+
+  void setText(const char* text);
+  void setInt(int32_t value, uint8_t minDigits = 0);
+  void setColor(Color color);
+  void setAlign(uint8_t align);
+
+protected:
+  void paint(Canvas& canvas);
+
+private:
+  char text[LABEL_CAPACITY + 1];
+  Color color;
+  uint8_t align = ALIGN_LEFT;
+};
+
+class BarWidget : public Widget
+{
+public:
+  BarWidget(int16_t x, int16_t y, int16_t width, int16_t height, Color fill = Color::green, Color background = Color::darkgray) :
+    Widget(x, y, width, height),
+    fill(fill),
+    background(background)
+  {
+  }
+
+  void setValue(uint16_t value, uint16_t max);
+
+protected:
+  void paint(Canvas& canvas);
+
+private:
+  Color fill;
+  Color background;
+  int16_t fillWidth = 0;
+};
+
+class ListWidget : public Widget
+{
+public:
+  ListWidget(int16_t x, int16_t y, int16_t width, int16_t height, Color color = Color::white, Color selectedColor = Color::yellow) :
+    Widget(x, y, width, height),
+    color(color),
+    selectedColor(selectedColor)
+  {
+  }
+
+  void setItems(const char* const* items, uint8_t count);
+  void setSelected(uint8_t index);
+  void selectNext();
+  void selectPrevious();
+
+  inline uint8_t getSelected() const
+  {
+    return selected;
+  }
+
+protected:
+  void paint(Canvas& canvas);
+
+private:
+  const char* const* items = NULL;
+  uint8_t count = 0;
+  uint8_t selected = 0;
+  uint8_t scroll = 0;
+  Color color;
+  Color selectedColor;
+};
+
+//-----------------------------------------------------------------------------
+// Audio
+//-----------------------------------------------------------------------------
+
+// Sound effects are note sequences played on AUDIO_VOICES pooled voices.
+// When no voice is free the oldest voice with the lowest priority is stolen
+// if its priority is not higher. Playing an effect already started in the
+// same frame does nothing. Nothing is allocated when playing.
+//
+// Music is a tracker style single channel song: an order list of patterns,
+// each pattern holds one byte per row, a MIDI note (60 is middle C),
+// NOTE_HOLD to keep the previous note or NOTE_OFF. Rows last rowFrames frames.
+
+#define NOTE_HOLD 0
+#define NOTE_OFF 0xFF
+
+struct Sfx
+{
+  const uint16_t* notes; // frequency (Hz, 0 is a rest), duration (frames) pairs
+  uint8_t noteCount;
+  uint8_t priority;
+};
+
+struct Music
+{
+  const uint8_t* const* patterns;
+  const uint8_t* order; // pattern indexes
+  uint8_t orderLength;
+  uint8_t patternLength;
+  uint8_t rowFrames;
+};
+
+//-----------------------------------------------------------------------------
+// Profiler
+//-----------------------------------------------------------------------------
+
+// Timings are stored in microseconds in a ring buffer of PROFILER_FRAMES
+// frames, one slot per phase, pool type and layer.
+
+#define PROFILE_WAIT 0
+#define PROFILE_UPDATE 1
+#define PROFILE_DRAW 2
+#define PROFILE_DEBUG 3
+#define PROFILE_POOL(type) ((type) < PROFILER_MAX_POOLS ? 4 + (type) : PROFILE_SLOTS)
+#define PROFILE_LAYER(layer) ((layer) < PROFILER_MAX_LAYERS ? 4 + PROFILER_MAX_POOLS + (layer) : PROFILE_SLOTS)
+#define PROFILE_SLOTS (4 + PROFILER_MAX_POOLS + PROFILER_MAX_LAYERS)
+
+#if PROFILER
+#define PROFILE(slot, time) gbx::_profile((slot), (time))
+#define PROFILE_BEGIN(name) uint32_t _profile_##name = micros()
+#define PROFILE_END(name, slot) PROFILE(slot, micros() - _profile_##name)
+#else
+#define PROFILE(slot, time)
+#define PROFILE_BEGIN(name)
+#define PROFILE_END(name, slot)
+#endif
+
+struct ProfileStats
+{
+  uint16_t min;
+  uint16_t avg;
+  uint16_t max;
+};
+
+//-----------------------------------------------------------------------------
+// Capture
+//-----------------------------------------------------------------------------
+
+// Per frame statistics, also streamed to the capture file when capturing.
+//
+// Capture file format (little endian), see tools/gbxcapture.py:
+//   header: "GBXC", uint8 version, uint8 pool count, uint16 reserved, uint32 frame duration (us)
+//   record: uint32 frame, uint16 wait (us), uint16 update (us), uint16 draw (us),
+//           uint16 query count, uint32 pixel count, uint16 entity count[pool count]
+
+#define CAPTURE_VERSION 1
+
+struct FrameStats
+{
+  uint32_t frame;
+  uint16_t waitTime;
+  uint16_t updateTime;
+  uint16_t drawTime;
+  uint16_t queryCount;
+  uint32_t pixelCount;
 };
 
 //-----------------------------------------------------------------------------
@@ -638,13 +2091,32 @@ namespace gbx
   void init(uint8_t frameRate = DEFAULT_FRAME_RATE);
   void update();
 
+  // When enabled the scene is updated once per elapsed frame duration: late
+  // frames run extra updates and drop their draw, at most maxFrameSkip in a row.
+  void setFixedTimestep(bool enabled, uint8_t maxFrameSkip = DEFAULT_MAX_FRAME_SKIP);
+  uint32_t getTick(); // Scene::getTick of the scene being updated or drawn
+
   // scene
   void setScene(Scene& scene);
   Scene& getScene();
 
+  // Scene::init and Scene::onLoad steps are spread over several frames, at
+  // most budget microseconds per frame (0 is half a frame) but at least one
+  // step. Scene::drawLoading is drawn until the scene becomes current.
+  void loadScene(Scene& scene, uint16_t budget = 0);
+  bool isLoading();
+
+  // Scene stack: the pushed scene is initialized and drawn over the current
+  // one, which stays in memory and resumes without init when popped. mode
+  // tells what the scene below does meanwhile, see SCENE_LIVE. setScene and
+  // loadScene empty the stack.
+  bool pushScene(Scene& scene, uint8_t mode = SCENE_PAUSE);
+  void popScene();
+  bool isOverlay(); // true while drawing a scene over another one
+
   // display
-  extern const int16_t width;
-  extern const int16_t height;
+  extern int16_t width;
+  extern int16_t height;
 
   void clear(Color color = Color::black);
 
@@ -659,14 +2131,121 @@ namespace gbx
   void drawCircle(int16_t x, int16_t y, int16_t r, Color c = Color::white);
   void fillCircle(int16_t x, int16_t y, int16_t r, Color c = Color::white);
 
+  Canvas& getCanvas();
+
+  // text, a NULL font uses the built-in font which is blitted directly, '\n'
+  // breaks the line
+  extern const Font defaultFont;
+
   void drawChar(int16_t x, int16_t y, char chr, Color c = Color::white, Gamebuino_Meta::GFXfont* font = NULL);
   void drawString(int16_t x, int16_t y, const char* str, Color c = Color::white, Gamebuino_Meta::GFXfont* font = NULL);
+  void drawText(int16_t x, int16_t y, const char* str, Color c = Color::white, uint8_t align = ALIGN_LEFT, const Font& font = defaultFont);
+  void drawInt(int16_t x, int16_t y, int32_t value, uint8_t minDigits = 0, Color c = Color::white, uint8_t align = ALIGN_LEFT);
+  uint16_t getTextWidth(const char* str, const Font& font = defaultFont);
+
   const char* format(const char* format...);
+  const char* formatInt(int32_t value, uint8_t minDigits = 0); // zero padded, no vsnprintf
 
   // input
   bool isDown(Gamebuino_Meta::Button button);
   bool wasPressed(Gamebuino_Meta::Button button);
   bool wasReleased(Gamebuino_Meta::Button button);
+
+#if POST_EFFECTS
+  // Applied to the whole screen after the scene is drawn, in a single pass
+  // with a color lookup table built when the settings change. Amounts go
+  // from 0 (no effect) to 256 (full color), durations are in ticks.
+  void setTint(Color color); // multiplies the colors, Color::white for none
+  void setFade(Color color, uint16_t amount);
+  void flash(Color color, uint8_t duration);
+  void shake(uint8_t amplitude, uint8_t duration);
+  void clearEffects();
+#endif
+
+#if SAVE_STATES
+  // Scene::saveState of the current scene to a file on the SD card. The file
+  // is written through a SAVE_BUFFER_SIZE buffer within the call, use
+  // startSaveState for autosaves during play.
+  //
+  // Format (little endian): "GBXS", uint8 version, uint8 pool count,
+  // uint16 reserved, int16 cameraX, int16 cameraY, camera (uint8 active,
+  // int32 x, int32 y in 8.8, uint8 target type or SAVE_NO_TARGET or
+  // SAVE_OTHER_TARGET, uint16 target index),
+  // then for each pool uint8 type, uint16 size and its state, then the scene
+  // payload. EntityPool state: for every 8 slots a uint8 active mask followed
+  // by the active entities (int16 x, int16 y, uint8 flags, payload).
+  bool saveState(const char* path);
+  bool loadState(const char* path);
+
+  // Autosave without dropping frames: the scene is saved into buffer right
+  // away (memory only), then the next calls to gbx::update open the file,
+  // write the buffer at most budget microseconds per frame (0 is a quarter of
+  // a frame) but at least SAVE_BUFFER_SIZE bytes, and close it. path and
+  // buffer must stay valid until isSaving() is false. false if a save is
+  // running or the scene does not fit in buffer.
+  bool startSaveState(const char* path, StateBuffer& buffer, uint16_t budget = 0);
+  bool isSaving();
+  bool hasSaveFailed(); // the file of the last startSaveState was not written
+#endif
+
+#if STRIP_RENDERER
+  // Draws the frames strip by strip (stripHeight rows at a time) and hands
+  // them to sink, for resolutions whose full buffer does not fit in RAM such
+  // as 160x128. The scene is drawn once per strip with the view clipped to the
+  // strip, so renderables only rasterize what overlaps it. NULL goes back to
+  // the 80x64 display buffer. Text drawn with a GFX font is not supported and
+  // SCENE_SNAPSHOT acts as SCENE_PAUSE while rendering by strips.
+  bool setStripRendering(DisplaySink* sink, int16_t width = 160, int16_t height = 128, uint8_t stripHeight = STRIP_DEFAULT_HEIGHT);
+#endif
+
+#if AUDIO
+  bool playSfx(const Sfx& sfx);
+  void stopSfx(const Sfx& sfx);
+  void stopAllSfx();
+
+  void playMusic(const Music& music, bool loop = true);
+  void stopMusic();
+  bool isMusicPlaying();
+#endif
+
+#if INPUT_REPLAY
+  // Records the button state of every frame (and the random seed) so that a
+  // session can be replayed exactly, for example to benchmark the same play
+  // session across versions together with gbx::startCapture. Replays are only
+  // deterministic with the fixed timestep disabled. Frames spent in
+  // gbx::loadScene are skipped, no buttons are down while loading.
+  //
+  // Log format (little endian): "GBXI", uint8 version, uint8[3] reserved,
+  // uint32 random seed, then (uint8 button mask, uint8 frame count) runs.
+  bool startRecording(const char* path);
+  void stopRecording();
+  bool isRecording();
+
+  bool startReplay(const char* path);
+  bool startReplay(const uint8_t* data, uint32_t size); // log baked in flash
+  void stopReplay();
+  bool isReplaying();
+#endif
+
+  // stats
+  const FrameStats& getFrameStats(); // last completed frame
+
+#if CAPTURE
+  bool startCapture(const char* path);
+  void stopCapture();
+  bool isCapturing();
+#endif
+
+#if COLLISION_STATS
+  // collision stats, of the last completed frame
+  const CollisionStats& getCollisionStats(uint8_t querierType, uint8_t targetType);
+#endif
+
+#if PROFILER
+  // profiler
+  ProfileStats getProfileStats(uint8_t slot);
+  void _profile(uint8_t slot, uint32_t time); // use PROFILE_BEGIN/PROFILE_END
+#endif
 }
 
 #endif
@@ -0,0 +1,373 @@
+#!/usr/bin/env python3
+#
+# Compiles PNG images and Tiled maps into a C++ header of constexpr arrays in
+# the formats read by Sprite::init, Anim::init and Tilemap::init.
+#
+#   gbxasset.py assets.json assets.h
+#
+# The manifest lists the assets, paths are relative to it:
+#
+#   {
+#     "sprites": [
+#       {"name": "player", "image": "player.png", "frame_width": 8, "frame_height": 8,
+#        "transparent": "#ff00ff",
+#        "animations": [{"name": "run", "frames": [0, 1, 2, 1], "interval": 4, "mode": "loop"}]}
+#     ],
+#     "tilesets": [
+#       {"name": "tiles", "image": "tiles.png", "tile_width": 8, "tile_height": 8}
+#     ],
+#     "tilemaps": [
+#       {"name": "level1", "map": "level1.tmx", "layer": "ground", "tileset": "tiles"},
+#       {"name": "world", "map": "world.json", "tileset": "tiles", "stream": "WORLD.GBM"}
+#     ]
+#   }
+#
+# Identical frames and tiles are stored once, animations and maps are
+# remapped accordingly. Maps use 8-bit cells when the tileset has fewer than
+# 255 tiles. Streamed maps are written as chunked map files (see gbxmap.py)
+# instead of arrays. Animation frames are checked against the frame count
+# here and again by static_asserts in the generated header.
+#
+
+import argparse
+import base64
+import json
+import os
+import re
+import struct
+import sys
+import xml.etree.ElementTree as ElementTree
+import zlib
+
+import gbxmap
+
+TILE_EMPTY = 0xFF
+TILED_FLIP_FLAGS = 0xE0000000
+DEFAULT_TRANSPARENT = 0xF81F  # magenta
+ANIM_MODES = {'loop': 0, 'one_shot': 1}
+
+
+def fail(message):
+    sys.exit('gbxasset: %s' % message)
+
+
+#------------------------------------------------------------------------------
+# PNG
+#------------------------------------------------------------------------------
+
+def read_png(path):
+    """Returns (width, height, rows of (r, g, b, a) pixels) for non interlaced 8-bit PNGs."""
+    with open(path, 'rb') as f:
+        data = f.read()
+    if data[:8] != b'\x89PNG\r\n\x1a\n':
+        fail('%s: not a PNG file' % path)
+
+    offset = 8
+    compressed = b''
+    palette = []
+    alphas = b''
+    while offset < len(data):
+        length, kind = struct.unpack_from('>I4s', data, offset)
+        chunk = data[offset + 8:offset + 8 + length]
+        offset += 12 + length
+        if kind == b'IHDR':
+            width, height, depth, color_type, _, _, interlace = struct.unpack('>IIBBBBB', chunk)
+        elif kind == b'PLTE':
+            palette = [tuple(chunk[i:i + 3]) for i in range(0, len(chunk), 3)]
+        elif kind == b'tRNS':
+            alphas = chunk
+        elif kind == b'IDAT':
+            compressed += chunk
+        elif kind == b'IEND':
+            break
+
+    channels = {0: 1, 2: 3, 3: 1, 4: 2, 6: 4}.get(color_type)
+    if depth != 8 or channels is None or interlace:
+        fail('%s: only 8-bit, non interlaced PNG images are supported' % path)
+
+    raw = zlib.decompress(compressed)
+    stride = width * channels
+    rows = []
+    previous = bytearray(stride)
+    offset = 0
+    for _ in range(height):
+        kind = raw[offset]
+        line = bytearray(raw[offset + 1:offset + 1 + stride])
+        offset += 1 + stride
+        for i in range(stride):
+            left = line[i - channels] if i >= channels else 0
+            up = previous[i]
+            up_left = previous[i - channels] if i >= channels else 0
+            if kind == 1:
+                line[i] = (line[i] + left) & 0xFF
+            elif kind == 2:
+                line[i] = (line[i] + up) & 0xFF
+            elif kind == 3:
+                line[i] = (line[i] + (left + up) // 2) & 0xFF
+            elif kind == 4:
+                p = left + up - up_left
+                pa, pb, pc = abs(p - left), abs(p - up), abs(p - up_left)
+                predictor = left if pa <= pb and pa <= pc else up if pb <= pc else up_left
+                line[i] = (line[i] + predictor) & 0xFF
+        previous = line
+
+        pixels = []
+        for x in range(width):
+            values = line[x * channels:(x + 1) * channels]
+            if color_type == 0:
+                pixels.append((values[0], values[0], values[0], 255))
+            elif color_type == 2:
+                pixels.append((values[0], values[1], values[2], 255))
+            elif color_type == 3:
+                index = values[0]
+                alpha = alphas[index] if index < len(alphas) else 255
+                pixels.append(palette[index] + (alpha,))
+            elif color_type == 4:
+                pixels.append((values[0], values[0], values[0], values[1]))
+            else:
+                pixels.append(tuple(values))
+        rows.append(pixels)
+
+    return width, height, rows
+
+
+def rgb565(r, g, b):
+    return ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3)
+
+
+def parse_color(text):
+    match = re.match(r'^#?([0-9a-fA-F]{6})$', text)
+    if not match:
+        fail('bad color %r, expected #rrggbb' % text)
+    value = int(match.group(1), 16)
+    return rgb565(value >> 16, (value >> 8) & 0xFF, value & 0xFF)
+
+
+def slice_frames(path, frame_width, frame_height, transparent):
+    """Cuts an image into RGB565 frames, row by row. Returns (frames, transparent color)."""
+    width, height, rows = read_png(path)
+    if frame_width <= 0 or frame_height <= 0 or width % frame_width or height % frame_height:
+        fail('%s: %dx%d is not a multiple of the %dx%d frame size' % (path, width, height, frame_width, frame_height))
+
+    has_alpha = any(pixel[3] < 128 for row in rows for pixel in row)
+    if transparent is not None:
+        color = parse_color(transparent)
+    elif has_alpha:
+        color = DEFAULT_TRANSPARENT
+    else:
+        color = 0  # Sprite treats 0 as no transparent color
+
+    frames = []
+    for frame_y in range(0, height, frame_height):
+        for frame_x in range(0, width, frame_width):
+            pixels = []
+            for y in range(frame_y, frame_y + frame_height):
+                for x in range(frame_x, frame_x + frame_width):
+                    r, g, b, a = rows[y][x]
+                    value = color if a < 128 else rgb565(r, g, b)
+                    if value == color and a >= 128 and color != 0:
+                        value ^= 0x0020  # an opaque pixel must not become transparent
+                    pixels.append(value)
+            frames.append(tuple(pixels))
+    return frames, color
+
+
+def dedupe(frames):
+    """Returns (unique frames, old index -> new index)."""
+    unique = []
+    indexes = {}
+    remap = []
+    for frame in frames:
+        if frame not in indexes:
+            indexes[frame] = len(unique)
+            unique.append(frame)
+        remap.append(indexes[frame])
+    return unique, remap
+
+
+#------------------------------------------------------------------------------
+# Tiled
+#------------------------------------------------------------------------------
+
+def decode_tmx_data(element, width, height, path):
+    encoding = element.get('encoding')
+    if encoding == 'csv':
+        return [int(value) for value in element.text.replace('\n', '').split(',') if value.strip()]
+    if encoding == 'base64':
+        raw = base64.b64decode(element.text.strip())
+        compression = element.get('compression')
+        if compression in ('zlib', 'gzip'):
+            raw = zlib.decompress(raw, 47)  # zlib or gzip header
+        elif compression:
+            fail('%s: unsupported %s compression' % (path, compression))
+        return list(struct.unpack('<%dI' % (width * height), raw))
+    fail('%s: unsupported layer encoding %r, use CSV or Base64' % (path, encoding))
+
+
+def read_tiled(path, layer_name):
+    """Returns rows of 0-based tile indexes (-1 is empty) of a layer of a Tiled JSON or TMX map."""
+    layers = []
+    if path.endswith('.json'):
+        with open(path) as f:
+            document = json.load(f)
+        first_gid = document['tilesets'][0]['firstgid'] if document.get('tilesets') else 1
+        for layer in document['layers']:
+            if layer.get('type') == 'tilelayer':
+                data = layer['data']
+                if isinstance(data, str):
+                    fail('%s: set the layer format to CSV' % path)
+                layers.append((layer['name'], layer['width'], layer['height'], data))
+    else:
+        root = ElementTree.parse(path).getroot()
+        tileset = root.find('tileset')
+        first_gid = int(tileset.get('firstgid')) if tileset is not None else 1
+        for layer in root.findall('layer'):
+            width, height = int(layer.get('width')), int(layer.get('height'))
+            layers.append((layer.get('name'), width, height, decode_tmx_data(layer.find('data'), width, height, path)))
+
+    for name, width, height, data in layers:
+        if layer_name is None or name == layer_name:
+            cells = [(gid & ~TILED_FLIP_FLAGS) - first_gid if gid else -1 for gid in data]
+            return [cells[y * width:(y + 1) * width] for y in range(height)]
+    fail('%s: no tile layer %s' % (path, layer_name or ''))
+
+
+#------------------------------------------------------------------------------
+# Output
+#------------------------------------------------------------------------------
+
+def identifier(name):
+    if not re.match(r'^[A-Za-z_][A-Za-z0-9_]*$', name):
+        fail('bad asset name %r' % name)
+    return name.upper()
+
+
+def array(out, type_name, name, values, per_line=16):
+    out.append('constexpr %s %s[] = {' % (type_name, name))
+    for i in range(0, len(values), per_line):
+        out.append('  ' + ', '.join(values[i:i + per_line]) + ',')
+    out.append('};')
+    out.append('')
+
+
+def hex16(values):
+    return ['0x%04x' % value for value in values]
+
+
+def compile_image(out, entry, base, size_keys):
+    name = identifier(entry['name'])
+    width, height = entry[size_keys[0]], entry[size_keys[1]]
+    frames, transparent = slice_frames(os.path.join(base, entry['image']), width, height, entry.get('transparent'))
+    unique, remap = dedupe(frames)
+
+    values = [width, height, transparent]
+    for frame in unique:
+        values.extend(frame)
+    out.append('// %s: %d frames (%d before merging identical ones)' % (entry['name'], len(unique), len(frames)))
+    out.append('constexpr uint16_t %s_FRAMES = %d;' % (name, len(unique)))
+    array(out, 'uint16_t', name + '_DATA', hex16(values))
+    return name, len(unique), remap
+
+
+def compile_sprite(out, entry, base):
+    name, frame_count, remap = compile_image(out, entry, base, ('frame_width', 'frame_height'))
+
+    animations = entry.get('animations', [])
+    if not animations:
+        return
+    values = []
+    for index, animation in enumerate(animations):
+        frames = animation['frames']
+        for frame in frames:
+            if not 0 <= frame < len(remap):
+                fail('%s.%s: frame %d out of range, the image has %d frames' %
+                     (entry['name'], animation['name'], frame, len(remap)))
+        mode = animation.get('mode', 'loop')
+        if mode not in ANIM_MODES:
+            fail('%s.%s: mode must be loop or one_shot' % (entry['name'], animation['name']))
+        if not 0 < len(frames) < 256 or not 0 <= animation.get('interval', 1) < 256:
+            fail('%s.%s: bad frame count or interval' % (entry['name'], animation['name']))
+        out.append('constexpr uint8_t %s_%s = %d;' % (name, identifier(animation['name']), index))
+        values.append('/* %s */ %d' % (animation['name'], len(frames)))
+        values.extend(str(value) for value in [ANIM_MODES[mode], animation.get('interval', 1)] + [remap[f] for f in frames])
+    out.append('')
+    array(out, 'uint8_t', name + '_ANIM', values)
+
+    # checked again by the compiler in case the header is edited by hand
+    offset = 0
+    for animation in animations:
+        for i in range(len(animation['frames'])):
+            out.append('static_assert(%s_ANIM[%d] < %s_FRAMES, "%s.%s: frame out of range");' %
+                       (name, offset + 3 + i, name, entry['name'], animation['name']))
+        offset += 3 + len(animation['frames'])
+    out.append('')
+
+
+def compile_tilemap(out, entry, base, output_dir, tilesets):
+    name = identifier(entry['name'])
+    if entry['tileset'] not in tilesets:
+        fail('%s: unknown tileset %s' % (entry['name'], entry['tileset']))
+    tile_count, remap = tilesets[entry['tileset']]
+
+    rows = read_tiled(os.path.join(base, entry['map']), entry.get('layer'))
+    for y, row in enumerate(rows):
+        for x, tile in enumerate(row):
+            if tile >= len(remap):
+                fail('%s: tile %d at %d,%d is not in tileset %s' % (entry['name'], tile, x, y, entry['tileset']))
+            row[x] = remap[tile] if tile >= 0 else -1
+    width, height = len(rows[0]), len(rows)
+
+    compact = tile_count < TILE_EMPTY
+    if 'stream' in entry:
+        path = os.path.join(output_dir, entry['stream'])
+        if compact:
+            gbxmap.write_map(path, rows, entry.get('chunk_size', 16), 'B', TILE_EMPTY)
+        else:
+            gbxmap.write_map(path, rows, entry.get('chunk_size', 16))
+        out.append('// %s: %dx%d tiles streamed from %s' % (entry['name'], width, height, entry['stream']))
+        out.append('')
+        return
+
+    if compact and width < 256 and height < 256:
+        values = [width, height] + [TILE_EMPTY if tile < 0 else tile for tile in sum(rows, [])]
+        out.append('// %s: %dx%d tiles, 8-bit cells' % (entry['name'], width, height))
+        array(out, 'uint8_t', name + '_MAP', [str(value) for value in values], 32)
+    else:
+        values = [width, height] + sum(rows, [])
+        out.append('// %s: %dx%d tiles' % (entry['name'], width, height))
+        array(out, 'int16_t', name + '_MAP', [str(value) for value in values], 32)
+
+
+def compile_manifest(path, output_dir):
+    with open(path) as f:
+        manifest = json.load(f)
+    base = os.path.dirname(os.path.abspath(path))
+
+    out = ['// Generated by gbxasset.py from %s, do not edit' % os.path.basename(path), '',
+           '#pragma once', '', '#include <stdint.h>', '']
+    for entry in manifest.get('sprites', []):
+        compile_sprite(out, entry, base)
+
+    tilesets = {}
+    for entry in manifest.get('tilesets', []):
+        _, tile_count, remap = compile_image(out, entry, base, ('tile_width', 'tile_height'))
+        tilesets[entry['name']] = (tile_count, remap)
+
+    for entry in manifest.get('tilemaps', []):
+        compile_tilemap(out, entry, base, output_dir, tilesets)
+    return out
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Compile PNG images and Tiled maps to a GBX asset header.')
+    parser.add_argument('manifest')
+    parser.add_argument('output')
+    args = parser.parse_args()
+
+    lines = compile_manifest(args.manifest, os.path.dirname(os.path.abspath(args.output)))
+    with open(args.output, 'w') as f:
+        f.write('\n'.join(lines).rstrip('\n') + '\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+#
+# Converts a GBX frame capture (see gbx::startCapture) to CSV or to a Chrome
+# trace (open it in chrome://tracing or https://ui.perfetto.dev).
+#
+#   gbxcapture.py CAPTURE.BIN --csv frames.csv
+#   gbxcapture.py CAPTURE.BIN --trace frames.json
+#   gbxcapture.py CAPTURE.BIN              (prints the frames over budget)
+#
+
+import argparse
+import csv
+import json
+import struct
+import sys
+
+HEADER = struct.Struct('<4sBBHI')
+RECORD = struct.Struct('<IHHHHI')
+VERSION = 1
+
+
+def read_capture(path):
+    with open(path, 'rb') as f:
+        data = f.read()
+
+    magic, version, pool_count, _, frame_duration = HEADER.unpack_from(data, 0)
+    if magic != b'GBXC':
+        sys.exit('%s: not a GBX capture' % path)
+    if version != VERSION:
+        sys.exit('%s: unsupported capture version %d' % (path, version))
+
+    counts = struct.Struct('<%dH' % pool_count)
+    frames = []
+    offset = HEADER.size
+    while offset + RECORD.size + counts.size <= len(data):
+        frame, wait, update, draw, queries, pixels = RECORD.unpack_from(data, offset)
+        offset += RECORD.size
+        frames.append({
+            'frame': frame,
+            'wait': wait,
+            'update': update,
+            'draw': draw,
+            'queries': queries,
+            'pixels': pixels,
+            'entities': counts.unpack_from(data, offset),
+        })
+        offset += counts.size
+
+    return frame_duration, pool_count, frames
+
+
+def busy(frame):
+    return frame['update'] + frame['draw']
+
+
+def write_csv(path, pool_count, frame_duration, frames):
+    with open(path, 'w', newline='') as f:
+        writer = csv.writer(f)
+        writer.writerow(['frame', 'wait_us', 'update_us', 'draw_us', 'busy_us', 'over_budget', 'queries', 'pixels'] +
+                        ['pool%d' % i for i in range(pool_count)])
+        for frame in frames:
+            writer.writerow([frame['frame'], frame['wait'], frame['update'], frame['draw'], busy(frame),
+                             int(busy(frame) > frame_duration), frame['queries'], frame['pixels']] +
+                            list(frame['entities']))
+
+
+def write_trace(path, pool_count, frame_duration, frames):
+    events = []
+    ts = 0
+
+    def span(name, start, duration, args=None):
+        event = {'name': name, 'ph': 'X', 'pid': 1, 'tid': 1, 'ts': start, 'dur': duration}
+        if args:
+            event['args'] = args
+        events.append(event)
+
+    for frame in frames:
+        span('wait', ts, frame['wait'])
+        ts += frame['wait']
+        span('frame %d' % frame['frame'], ts, busy(frame), {'queries': frame['queries'], 'pixels': frame['pixels']})
+        span('update', ts, frame['update'])
+        span('draw', ts + frame['update'], frame['draw'])
+        if busy(frame) > frame_duration:
+            events.append({'name': 'over budget', 'ph': 'i', 's': 'g', 'pid': 1, 'tid': 1, 'ts': ts})
+        events.append({'name': 'entities', 'ph': 'C', 'pid': 1, 'ts': ts,
+                       'args': dict(('pool%d' % i, n) for i, n in enumerate(frame['entities']) if n)})
+        events.append({'name': 'work', 'ph': 'C', 'pid': 1, 'ts': ts,
+                       'args': {'queries': frame['queries'], 'pixels': frame['pixels']}})
+        ts += busy(frame)
+
+    with open(path, 'w') as f:
+        json.dump({'traceEvents': events, 'displayTimeUnit': 'ms'}, f)
+
+
+def print_summary(frame_duration, frames):
+    over = [frame for frame in frames if busy(frame) > frame_duration]
+    print('%d frames, budget %dus, %d over budget' % (len(frames), frame_duration, len(over)))
+    for frame in over:
+        print('  frame %6d: update=%5dus draw=%5dus queries=%5d pixels=%6d entities=%d' % (
+            frame['frame'], frame['update'], frame['draw'], frame['queries'], frame['pixels'], sum(frame['entities'])))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Convert a GBX frame capture.')
+    parser.add_argument('capture')
+    parser.add_argument('--csv', help='write one row per frame to this file')
+    parser.add_argument('--trace', help='write a Chrome trace to this file')
+    args = parser.parse_args()
+
+    frame_duration, pool_count, frames = read_capture(args.capture)
+    if args.csv:
+        write_csv(args.csv, pool_count, frame_duration, frames)
+    if args.trace:
+        write_trace(args.trace, pool_count, frame_duration, frames)
+    if not args.csv and not args.trace:
+        print_summary(frame_duration, frames)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+#
+# Converts a CSV tile map (one row of comma separated tile indices per line,
+# -1 is empty) to the chunked map file read by StreamingTilemap.
+#
+#   gbxmap.py level.csv LEVEL.GBM [--chunk-size 16] [--tiled] [--wide]
+#
+# With --tiled the values are Tiled global ids (0 is empty, first tile is 1).
+# Maps using fewer than 255 tiles are written with 8-bit cells (0xFF is empty),
+# --wide forces 16-bit cells.
+#
+
+import argparse
+import struct
+import sys
+
+VERSION = 1
+EMPTY = -1
+COMPACT_EMPTY = 0xFF
+
+
+def read_csv(path, tiled):
+    rows = []
+    with open(path) as f:
+        for line in f:
+            line = line.strip().rstrip(',')
+            if line:
+                rows.append([int(value) - (1 if tiled else 0) for value in line.split(',')])
+
+    width = max(len(row) for row in rows)
+    for row in rows:
+        row.extend([EMPTY] * (width - len(row)))
+    return rows
+
+
+def write_map(path, rows, chunk_size, cell_format='h', empty=EMPTY):
+    height = len(rows)
+    width = len(rows[0])
+    if width > 0xFFFF or height > 0xFFFF:
+        sys.exit('map too big: %dx%d' % (width, height))
+
+    cell = struct.Struct('<' + cell_format)
+    with open(path, 'wb') as f:
+        f.write(struct.pack('<4sBBBBHH', b'GBXM', VERSION, cell.size, chunk_size, 0, width, height))
+        for chunk_y in range(0, height, chunk_size):
+            for chunk_x in range(0, width, chunk_size):
+                for y in range(chunk_y, chunk_y + chunk_size):
+                    for x in range(chunk_x, chunk_x + chunk_size):
+                        value = rows[y][x] if y < height and x < width else EMPTY
+                        f.write(cell.pack(empty if value < 0 else value))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Convert a CSV tile map to a GBX chunked map file.')
+    parser.add_argument('csv')
+    parser.add_argument('output')
+    parser.add_argument('--chunk-size', type=int, default=16)
+    parser.add_argument('--tiled', action='store_true', help='values are Tiled global ids')
+    parser.add_argument('--wide', action='store_true', help='always write 16-bit cells')
+    args = parser.parse_args()
+
+    if not 1 <= args.chunk_size <= 255:
+        sys.exit('chunk size must be between 1 and 255')
+
+    rows = read_csv(args.csv, args.tiled)
+    if args.wide or max(max(row) for row in rows) >= COMPACT_EMPTY:
+        write_map(args.output, rows, args.chunk_size)
+    else:
+        write_map(args.output, rows, args.chunk_size, 'B', COMPACT_EMPTY)
+
+
+if __name__ == '__main__':
+    main()